@@ -0,0 +1,44 @@
+/*
+** Allocation counter for the benchmark harness.
+**
+** Preloaded into an interpreter with LD_PRELOAD. Counts calls to
+** malloc, calloc and realloc and writes the total to the file
+** descriptor named by LISPY_ALLOC_FD when the process exits.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t n);
+extern void* __libc_calloc(size_t n, size_t m);
+extern void* __libc_realloc(void* p, size_t n);
+
+static unsigned long long alloc_count = 0;
+
+void* malloc(size_t n) {
+  __sync_fetch_and_add(&alloc_count, 1);
+  return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t m) {
+  __sync_fetch_and_add(&alloc_count, 1);
+  return __libc_calloc(n, m);
+}
+
+void* realloc(void* p, size_t n) {
+  __sync_fetch_and_add(&alloc_count, 1);
+  return __libc_realloc(p, n);
+}
+
+__attribute__((destructor))
+static void alloc_count_report(void) {
+  char* fd = getenv("LISPY_ALLOC_FD");
+  if (!fd) { return; }
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), "%llu", alloc_count);
+  if (write(atoi(fd), buf, n) < 0) { return; }
+}
@@ -0,0 +1,191 @@
+/*
+** Benchmark harness for the Lispy interpreters.
+**
+** Usage: bench [-r reps] [-a alloc_count.so] [-b baseline]
+**          interpreter... -- workload...
+**
+** Runs every workload with every interpreter `reps` times and prints
+** one JSON object per line with the mean wall time per run, the mean
+** number of heap allocations per run (when an allocation counting
+** library is given with -a) and the peak resident set size.
+**
+** Starting the interpreter and loading the prelude take time in every
+** run, so a baseline workload given with -b, which does only that, is
+** run the same number of times first. Its mean time and allocations
+** are reported as baseline_ns and baseline_allocs and taken off those
+** of every workload, leaving only the work the workload adds.
+**
+** Workloads are run from the current directory with their output
+** discarded and with an unlimited stack, since the prelude functions
+** recurse once per list element.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* File descriptor the allocation counter reports on */
+#define BENCH_ALLOC_FD 3
+
+typedef struct {
+  int status;
+  long long ns;
+  long long allocs;
+  long rss_kb;
+} bench_run;
+
+static long long bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static bench_run bench_once(char* interp, char* workload, char* shim) {
+  
+  bench_run r = { -1, 0, -1, 0 };
+  
+  int fds[2];
+  if (pipe(fds) != 0) { return r; }
+  
+  long long start = bench_now();
+  pid_t pid = fork();
+  
+  if (pid == 0) {
+    
+    /* Output is discarded, allocations are reported on their own fd */
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(fds[0]);
+    dup2(fds[1], BENCH_ALLOC_FD);
+    
+    struct rlimit stack = { RLIM_INFINITY, RLIM_INFINITY };
+    setrlimit(RLIMIT_STACK, &stack);
+    
+    if (shim) {
+      char fd[16];
+      sprintf(fd, "%i", BENCH_ALLOC_FD);
+      setenv("LD_PRELOAD", shim, 1);
+      setenv("LISPY_ALLOC_FD", fd, 1);
+    }
+    
+    execl(interp, interp, workload, (char*)NULL);
+    _exit(127);
+  }
+  
+  close(fds[1]);
+  if (pid < 0) { close(fds[0]); return r; }
+  
+  /* Allocation count is written once as the child exits */
+  char buf[64];
+  ssize_t n = read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  
+  r.ns = bench_now() - start;
+  r.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  r.rss_kb = usage.ru_maxrss;
+  if (n > 0) { buf[n] = '\0'; r.allocs = atoll(buf); }
+  
+  return r;
+}
+
+/* Mean of `reps` runs of a workload, and the worst exit status */
+static bench_run bench_mean(char* interp, char* workload, char* shim, int reps) {
+  
+  bench_run m = { 0, 0, 0, 0 };
+  
+  for (int k = 0; k < reps; k++) {
+    bench_run r = bench_once(interp, workload, shim);
+    m.ns += r.ns;
+    m.allocs = (m.allocs < 0 || r.allocs < 0) ? -1 : m.allocs + r.allocs;
+    if (r.rss_kb > m.rss_kb) { m.rss_kb = r.rss_kb; }
+    if (r.status != 0) { m.status = r.status; }
+  }
+  
+  m.ns /= reps;
+  if (m.allocs > 0) { m.allocs /= reps; }
+  return m;
+}
+
+static char* bench_name(char* path) {
+  char* base = strrchr(path, '/');
+  return base ? base + 1 : path;
+}
+
+int main(int argc, char** argv) {
+  
+  int reps = 3;
+  char* shim = NULL;
+  char* baseline = NULL;
+  
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--") != 0; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i+1 < argc) { reps = atoi(argv[++i]); continue; }
+    if (strcmp(argv[i], "-a") == 0 && i+1 < argc) { shim = argv[++i]; continue; }
+    if (strcmp(argv[i], "-b") == 0 && i+1 < argc) { baseline = argv[++i]; continue; }
+    fprintf(stderr, "bench: unknown option %s\n", argv[i]);
+    return 1;
+  }
+  
+  int interps = i;
+  while (i < argc && strcmp(argv[i], "--") != 0) { i++; }
+  int interps_end = i;
+  int workloads = i + 1;
+  
+  if (interps == interps_end || workloads >= argc || reps < 1) {
+    fprintf(stderr, "usage: bench [-r reps] [-a alloc_count.so] [-b baseline] "
+      "interpreter... -- workload...\n");
+    return 1;
+  }
+  
+  int failed = 0;
+  
+  /* Baseline of each interpreter, or nothing to take off */
+  int count = interps_end - interps;
+  bench_run* base = calloc(count, sizeof(bench_run));
+  for (int p = 0; p < count && baseline; p++) {
+    base[p] = bench_mean(argv[interps + p], baseline, shim, reps);
+    if (base[p].status != 0) {
+      fprintf(stderr, "bench: baseline %s failed with %s\n", baseline, argv[interps + p]);
+      return 1;
+    }
+  }
+  
+  for (int w = workloads; w < argc; w++) {
+    for (int p = interps; p < interps_end; p++) {
+      
+      bench_run b = base[p - interps];
+      bench_run r = bench_mean(argv[p], argv[w], shim, reps);
+      
+      /* Noise can leave a workload quicker than the baseline */
+      long long ns = r.ns > b.ns ? r.ns - b.ns : 0;
+      long long allocs = (r.allocs < 0 || b.allocs < 0) ? -1
+        : (r.allocs > b.allocs ? r.allocs - b.allocs : 0);
+      
+      printf("{\"interpreter\": \"%s\", \"workload\": \"%s\", \"reps\": %i, "
+        "\"ns_per_op\": %lld, \"allocs_per_op\": %lld, \"peak_rss_kb\": %ld, "
+        "\"baseline_ns\": %lld, \"baseline_allocs\": %lld, \"status\": %i}\n",
+        bench_name(argv[p]), bench_name(argv[w]), reps,
+        ns, allocs, r.rss_kb, b.ns, b.allocs, r.status);
+      fflush(stdout);
+      
+      if (r.status != 0) { failed = 1; }
+    }
+  }
+  
+  free(base);
+  
+  return failed;
+}
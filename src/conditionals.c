@@ -774,8 +774,20 @@ lval* lval_read(mpc_ast_t* t) {
 
 /* Main */
 
+/*
+** When built with LISPY_GRAMMAR, the parsers come precompiled from
+** conditionals_grammar.c, which mpc_gen writes from conditionals.grammar,
+** and no grammar is built at startup. The grammar in main must match it.
+*/
+#ifdef LISPY_GRAMMAR
+extern mpc_parser_t* lispy_lispy;
+#endif
+
 int main(int argc, char** argv) {
   
+#ifdef LISPY_GRAMMAR
+  mpc_parser_t* Lispy = lispy_lispy;
+#else
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
   mpc_parser_t* Sexpr  = mpc_new("sexpr");
@@ -793,6 +805,7 @@ int main(int argc, char** argv) {
       lispy  : /^/ <expr>* /$/ ;                          \
     ",
     Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+#endif
   
   puts("Lispy Version 0.0.0.0.9");
   puts("Press Ctrl+c to Exit\n");
@@ -824,7 +837,10 @@ int main(int argc, char** argv) {
   
   lenv_del(e);
   
+  /* Precompiled parsers are static and are not deleted */
+#ifndef LISPY_GRAMMAR
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+#endif
   
   return 0;
 }
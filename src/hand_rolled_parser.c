@@ -52,6 +52,7 @@ struct lval {
   lenv* env;
   lval* formals;
   lval* body;
+  int form;
   
   /* Expression */
   int count;
@@ -97,6 +98,7 @@ lval* lval_builtin(lbuiltin func) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->form = 0;
   return v;
 }
 
@@ -109,6 +111,7 @@ lval* lval_lambda(lval* formals, lval* body) {
   v->env = lenv_new();  
   v->formals = formals;
   v->body = body;
+  v->form = 0;
   return v;  
 }
 
@@ -130,36 +133,108 @@ lval* lval_qexpr(void) {
 
 void lenv_del(lenv* e);
 
-void lval_del(lval* v) {
+/* Nesting below which lval_del recurses rather than deferring */
+#define LVAL_DEL_DEPTH 256
 
-  switch (v->type) {
-    case LVAL_NUM: break;
-    case LVAL_FUN: 
-      if (!v->builtin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
-      }
-    break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
-      }
-      free(v->cell);
-    break;
-  }
+void lval_del_nested(lval* v, int depth) {
+  
+  /* Expressions nested too deeply to recurse into are chained through
+     their unused body field and deleted in this loop instead */
+  lval* next = NULL;
   
-  free(v);
+  while (v) {
+    
+    switch (v->type) {
+      case LVAL_NUM: break;
+      case LVAL_FUN: 
+        if (!v->builtin) {
+          lenv_del(v->env);
+          lval_del_nested(v->formals, 0);
+          lval_del_nested(v->body, 0);
+        }
+      break;
+      case LVAL_ERR: free(v->err); break;
+      case LVAL_SYM: free(v->sym); break;
+      case LVAL_STR: free(v->str); break;
+      case LVAL_QEXPR:
+      case LVAL_SEXPR:
+        for (int i = 0; i < v->count; i++) {
+          lval* c = v->cell[i];
+          if (depth >= LVAL_DEL_DEPTH
+          && (c->type == LVAL_SEXPR || c->type == LVAL_QEXPR)) {
+            c->body = next;
+            next = c;
+          } else {
+            lval_del_nested(c, depth+1);
+          }
+        }
+        free(v->cell);
+      break;
+    }
+    
+    free(v);
+    
+    v = next;
+    if (v) { next = v->body; }
+  }
+}
+
+void lval_del(lval* v) { lval_del_nested(v, 0); }
+
+/*
+** Copying, printing and comparing keep the parts of a value left to
+** visit on a stack of their own, as data can be nested deeper than
+** the C stack allows. What the second field of each part means is up
+** to the walk.
+*/
+
+#define LWALK_INLINE 32
+
+typedef struct {
+  lval* x;
+  void* y;
+} lwalk_item;
+
+typedef struct {
+  int count;
+  int slots;
+  lwalk_item* items;
+  lwalk_item inline_items[LWALK_INLINE];
+} lwalk;
+
+void lwalk_init(lwalk* w) {
+  w->count = 0;
+  w->slots = LWALK_INLINE;
+  w->items = w->inline_items;
+}
+
+void lwalk_push(lwalk* w, lval* x, void* y) {
+  if (w->count == w->slots) {
+    w->slots *= 2;
+    if (w->items == w->inline_items) {
+      w->items = malloc(sizeof(lwalk_item) * w->slots);
+      memcpy(w->items, w->inline_items, sizeof(w->inline_items));
+    } else {
+      w->items = realloc(w->items, sizeof(lwalk_item) * w->slots);
+    }
+  }
+  w->items[w->count].x = x;
+  w->items[w->count].y = y;
+  w->count++;
+}
+
+lwalk_item lwalk_pop(lwalk* w) {
+  return w->items[--w->count];
+}
+
+void lwalk_del(lwalk* w) {
+  if (w->items != w->inline_items) { free(w->items); }
 }
 
 lenv* lenv_copy(lenv* e);
 
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
+/* Copy v into x, leaving the parts inside it for the walk to copy */
+void lval_copy_one(lwalk* w, lval* v, lval* x) {
   x->type = v->type;
   switch (v->type) {
     case LVAL_FUN:
@@ -168,9 +243,10 @@ lval* lval_copy(lval* v) {
       } else {
         x->builtin = NULL;
         x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        lwalk_push(w, v->formals, &x->formals);
+        lwalk_push(w, v->body, &x->body);
       }
+      x->form = v->form;
     break;
     case LVAL_NUM: x->num = v->num; break;
     case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
@@ -187,10 +263,25 @@ lval* lval_copy(lval* v) {
       x->count = v->count;
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+        lwalk_push(w, v->cell[i], &x->cell[i]);
       }
     break;
   }
+}
+
+/* Each part left to copy is paired with the place its copy goes */
+lval* lval_copy(lval* v) {
+  lval* x;
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, v, &x);
+  while (w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    lval* y = malloc(sizeof(lval));
+    *(lval**)i.y = y;
+    lval_copy_one(&w, i.x, y);
+  }
+  lwalk_del(&w);
   return x;
 }
 
@@ -225,17 +316,13 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-void lval_print(lval* v);
-
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);    
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
+void lval_print_expr(lwalk* w, lval* v, char* open, char* close) {
+  printf("%s", open);
+  lwalk_push(w, NULL, close);
+  for (int i = v->count-1; i >= 0; i--) {
+    lwalk_push(w, v->cell[i], NULL);
+    if (i) { lwalk_push(w, NULL, " "); }
   }
-  putchar(close);
 }
 
 /* Possible unescapable characters */
@@ -293,31 +380,46 @@ void lval_print_str(lval* v) {
   putchar('"');
 }
 
+/* Parts without a value are text to print once the parts before are done */
 void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_FUN:
-      if (v->builtin) {
-        printf("<builtin>");
-      } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
-      }
-    break;
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+  
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, v, NULL);
+  
+  while (w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    v = i.x;
+    if (!v) { printf("%s", (char*)i.y); continue; }
+    
+    switch (v->type) {
+      case LVAL_FUN:
+        if (v->builtin) {
+          printf("<builtin>");
+        } else {
+          printf("(\\ ");
+          lwalk_push(&w, NULL, ")");
+          lwalk_push(&w, v->body, NULL);
+          lwalk_push(&w, NULL, " ");
+          lwalk_push(&w, v->formals, NULL);
+        }
+      break;
+      case LVAL_NUM:   printf("%li", v->num); break;
+      case LVAL_ERR:   printf("Error: %s", v->err); break;
+      case LVAL_SYM:   printf("%s", v->sym); break;
+      case LVAL_STR:   lval_print_str(v); break;
+      case LVAL_SEXPR: lval_print_expr(&w, v, "(", ")"); break;
+      case LVAL_QEXPR: lval_print_expr(&w, v, "{", "}"); break;
+    }
   }
+  
+  lwalk_del(&w);
 }
 
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
-int lval_eq(lval* x, lval* y) {
+/* Compare x and y alone, leaving the pairs of parts inside them for later */
+int lval_eq_one(lwalk* w, lval* x, lval* y) {
   
   if (x->type != y->type) { return 0; }
   
@@ -330,13 +432,15 @@ int lval_eq(lval* x, lval* y) {
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
-        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+        lwalk_push(w, x->body, y->body);
+        lwalk_push(w, x->formals, y->formals);
+        return 1;
       }    
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       if (x->count != y->count) { return 0; }
-      for (int i = 0; i < x->count; i++) {
-        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+      for (int i = x->count-1; i >= 0; i--) {
+        lwalk_push(w, x->cell[i], y->cell[i]);
       }
       return 1;
     break;
@@ -344,6 +448,19 @@ int lval_eq(lval* x, lval* y) {
   return 0;
 }
 
+int lval_eq(lval* x, lval* y) {
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, x, y);
+  int eq = 1;
+  while (eq && w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    eq = lval_eq_one(&w, i.x, i.y);
+  }
+  lwalk_del(&w);
+  return eq;
+}
+
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
@@ -499,6 +616,17 @@ lval* builtin_tail(lenv* e, lval* a) {
   return v;
 }
 
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+  
+  long n = a->cell[0]->num;
+  lval* v = lval_take(a, 1);
+  while (v->count > n && v->count > 0) { lval_del(lval_pop(v, v->count-1)); }
+  return v;
+}
+
 lval* builtin_eval(lenv* e, lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
@@ -641,6 +769,128 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
+/* Evaluate each argument, returning the last, or the empty list if there are none */
+lval* builtin_do(lenv* e, lval* a) {
+  if (a->count == 0) { lval_del(a); return lval_qexpr(); }
+  return lval_take(a, a->count-1);
+}
+
+/* Evaluate the body in a new scope */
+lval* builtin_let(lenv* e, lval* a) {
+  LASSERT_NUM("let", a, 1);
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+  
+  lenv* scope = lenv_new();
+  scope->par = e;
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+  x = lval_eval(scope, x);
+  lenv_del(scope);
+  return x;
+}
+
+/*
+** and and or are forms, so they are given their arguments unevaluated
+** and stop at the first one which decides the result, returning it.
+*/
+lval* builtin_logic(lenv* e, lval* a, char* op) {
+  
+  lval* x = lval_num(strcmp(op, "and") == 0);
+  while (a->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(a, 0));
+    if (x->type == LVAL_ERR) { break; }
+    if (x->type != LVAL_NUM) {
+      lval* err = lval_err("Function '%s' passed incorrect type. "
+        "Got %s, Expected %s.", op, ltype_name(x->type), ltype_name(LVAL_NUM));
+      lval_del(x);
+      x = err;
+      break;
+    }
+    if (strcmp(op, "and") == 0 && !x->num) { break; }
+    if (strcmp(op, "or") == 0 && x->num) { break; }
+  }
+  
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, "and"); }
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, "or"); }
+
+/*
+** Each clause of select and case is a Q-Expression holding a
+** condition or key followed by the code to run when it matches.
+** Only the clauses up to the one which matches are evaluated.
+*/
+#define LASSERT_CLAUSE(func, args, index) \
+  LASSERT(args, args->cell[index]->count == 2, \
+    "Function '%s' passed incorrect clause for argument %i. Got %i items, Expected %i.", \
+    func, index, args->cell[index]->count, 2)
+
+lval* lval_eval_clause(lenv* e, lval* c) {
+  c->type = LVAL_SEXPR;
+  return lval_eval(e, c);
+}
+
+lval* builtin_select(lenv* e, lval* a) {
+  
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+    LASSERT_CLAUSE("select", a, i);
+  }
+  
+  while (a->count) {
+    lval* c = lval_pop(a, 0);
+    lval* x = lval_eval(e, lval_pop(c, 0));
+    if (x->type != LVAL_NUM) {
+      lval* err = x->type == LVAL_ERR ? x : lval_err(
+        "Function 'select' passed incorrect type for condition. "
+        "Got %s, Expected %s.", ltype_name(x->type), ltype_name(LVAL_NUM));
+      if (err != x) { lval_del(x); }
+      lval_del(c); lval_del(a);
+      return err;
+    }
+    if (x->num) {
+      lval_del(x); lval_del(a);
+      return lval_eval_clause(e, c);
+    }
+    lval_del(x); lval_del(c);
+  }
+  
+  lval_del(a);
+  return lval_err("No Selection Found");
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+  
+  LASSERT(a, a->count > 0,
+    "Function 'case' passed incorrect number of arguments. "
+    "Got %i, Expected at least %i.", a->count, 1);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_TYPE("case", a, i, LVAL_QEXPR);
+    LASSERT_CLAUSE("case", a, i);
+  }
+  
+  lval* v = lval_pop(a, 0);
+  while (a->count) {
+    lval* c = lval_pop(a, 0);
+    lval* k = lval_eval(e, lval_pop(c, 0));
+    if (k->type == LVAL_ERR) {
+      lval_del(v); lval_del(c); lval_del(a);
+      return k;
+    }
+    if (lval_eq(v, k)) {
+      lval_del(v); lval_del(k); lval_del(a);
+      return lval_eval_clause(e, c);
+    }
+    lval_del(k); lval_del(c);
+  }
+  
+  lval_del(v); lval_del(a);
+  return lval_err("No Case Found");
+}
+
 /* Change forward declaration */
 lval* lval_read_expr(char* s, int* i, char end);
 
@@ -710,6 +960,15 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval_del(k); lval_del(v);
 }
 
+/* Forms are builtins which are passed their arguments unevaluated */
+void lenv_add_form(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->form = 1;
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
 void lenv_add_builtins(lenv* e) {
   /* Variable Functions */
   lenv_add_builtin(e, "\\",  builtin_lambda); 
@@ -722,6 +981,7 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "take", builtin_take);
   
   /* Mathematical Functions */
   lenv_add_builtin(e, "+", builtin_add);
@@ -731,6 +991,12 @@ void lenv_add_builtins(lenv* e) {
   
   /* Comparison Functions */
   lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, "do", builtin_do);
+  lenv_add_builtin(e, "let", builtin_let);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case", builtin_case);
+  lenv_add_form(e, "and", builtin_and);
+  lenv_add_form(e, "or",  builtin_or);
   lenv_add_builtin(e, "==", builtin_eq);
   lenv_add_builtin(e, "!=", builtin_ne);
   lenv_add_builtin(e, ">",  builtin_gt);
@@ -811,7 +1077,13 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
   
-  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
+  /* Forms take their arguments unevaluated, so evaluate the head first */
+  int args = 0;
+  if (v->count) {
+    v->cell[0] = lval_eval(e, v->cell[0]);
+    args = v->cell[0]->type != LVAL_FUN || !v->cell[0]->form;
+  }
+  for (int i = 1; i < v->count && args; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
   for (int i = 0; i < v->count; i++) { if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); } }
   
   if (v->count == 0) { return v; }  
@@ -844,183 +1116,198 @@ lval* lval_eval(lenv* e, lval* v) {
 
 /* Reading */
 
+/* Character classes used by the reader */
+enum { LCHAR_SYM = 1, LCHAR_DIGIT = 2, LCHAR_SPACE = 4 };
+
+/* Class of every possible input character, filled by lval_read_init */
+unsigned char lval_char_class[256];
+
+void lval_read_init(void) {
+  char* sym = 
+    "abcdefghijklmnopqrstuvwxyz"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "0123456789_+-*\\/=<>!&";
+  char* digit = "0123456789";
+  char* space = " \t\v\r\n";
+  
+  memset(lval_char_class, 0, sizeof(lval_char_class));
+  for (char* c = sym;   *c; c++) { lval_char_class[(unsigned char)*c] |= LCHAR_SYM;   }
+  for (char* c = digit; *c; c++) { lval_char_class[(unsigned char)*c] |= LCHAR_DIGIT; }
+  for (char* c = space; *c; c++) { lval_char_class[(unsigned char)*c] |= LCHAR_SPACE; }
+}
+
+#define LCHAR_IS(c, cls) (lval_char_class[(unsigned char)(c)] & (cls))
+
 lval* lval_read_sym(char* s, int* i) {
   
-  /* Allocate Empty String */
-  char* part = calloc(1,1);
+  int start = *i;
   
-  /* While valid identifier characters */
-  while (strchr(
-      "abcdefghijklmnopqrstuvwxyz"
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-      "0123456789_+-*\\/=<>!&", s[*i]) && s[*i] != '\0') {
-    
-    /* Append character to end of string */
-    part = realloc(part, strlen(part)+2);
-    part[strlen(part)+1] = '\0';
-    part[strlen(part)+0] = s[*i];
+  /* Identifier looks like a number if it is digits with an optional minus */
+  int is_num = LCHAR_IS(s[*i], LCHAR_DIGIT) || s[*i] == '-';
+  
+  /* Scan to the end of the identifier checking for digits as we go */
+  (*i)++;
+  while (LCHAR_IS(s[*i], LCHAR_SYM)) {
+    if (!LCHAR_IS(s[*i], LCHAR_DIGIT)) { is_num = 0; }
     (*i)++;
   }
   
-  /* Check if Identifier looks like number */
-  int is_num = strchr("-0123456789", part[0]) != NULL;
-  for (int j = 1; j < strlen(part); j++) {
-    if (strchr("0123456789", part[j]) == NULL) { is_num = 0; break; }
-  }
-  if (strlen(part) == 1 && part[0] == '-') { is_num = 0; }
+  int len = *i - start;
+  if (len == 1 && s[start] == '-') { is_num = 0; }
   
-  /* Add Symbol or Number as lval */
-  lval* x = NULL;
+  /* Numbers are converted straight from the input */
   if (is_num) {
     errno = 0;
-    long v = strtol(part, NULL, 10);
-    x = (errno != ERANGE) ? lval_num(v) : lval_err("Invalid Number %s", part);
-  } else {
-    x = lval_sym(part);
+    long v = strtol(s + start, NULL, 10);
+    return (errno != ERANGE) ? lval_num(v) : 
+      lval_err("Invalid Number %.*s", len, s + start);
   }
   
-  /* Free temp string */
-  free(part);
-  
-  /* Return lval */
+  /* Symbols are copied with a single allocation */
+  lval* x = malloc(sizeof(lval));
+  x->type = LVAL_SYM;
+  x->sym = malloc(len + 1);
+  memcpy(x->sym, s + start, len);
+  x->sym[len] = '\0';
   return x;
 }
 
 lval* lval_read_str(char* s, int* i) {
   
-  /* Allocate empty string */
-  char* part = calloc(1,1);
-  
-  /* More forward one step past initial " character */
+  /* Move forward one step past initial " character */
   (*i)++;
-  while (s[*i] != '"') {
-    
-    char c = s[*i];
+  
+  /* Find the closing " character and check escapes on the way */
+  int end = *i;
+  while (s[end] != '"') {
     
     /* If end of input then there is an unterminated string literal */
-    if (c == '\0') {
-      free(part);
+    if (s[end] == '\0') {
       return lval_err("Unexpected end of input");
     }
     
-    /* If backslash then unescape character after it */
-    if (c == '\\') {
-      (*i)++;
-      /* Check next character is escapable */
-      if (strchr(lval_str_unescapable, s[*i])) {        
-        c = lval_str_unescape(s[*i]);
-      } else {
-        free(part);
-        return lval_err("Invalid escape sequence \\%c", s[*i]);
+    /* Check character after backslash is escapable */
+    if (s[end] == '\\') {
+      end++;
+      if (s[end] == '\0' || !strchr(lval_str_unescapable, s[end])) {
+        return lval_err("Invalid escape sequence \\%c", s[end]);
       }
     }
-    
-    /* Append character to string */
-    part = realloc(part, strlen(part)+2);
-    part[strlen(part)+1] = '\0';
-    part[strlen(part)+0] = c;
-    (*i)++;    
+    end++;
   }
-  /* Move forward past final " character */
-  (*i)++;
   
-  lval* x = lval_str(part);
-  
-  /* free temp string */
-  free(part);
-  
-  return x;
-}
-
-lval* lval_read(char* s, int* i);
-
-lval* lval_read_expr(char* s, int* i, char end) {
-  
-  /* Either create new qexpr or sexpr */
-  lval* x = (end == '}') ? lval_qexpr() : lval_sexpr();
-  
-  /* While not at end character keep reading lvals */
-  while (s[*i] != end) {
-    lval* y = lval_read(s, i);
-    /* If an error then return this and stop */
-    if (y->type == LVAL_ERR) {
-      lval_del(x);
-      return y;
+  /* Unescape into a string long enough for the raw contents */
+  char* part = malloc(end - *i + 1);
+  int len = 0;
+  while (*i < end) {
+    if (s[*i] == '\\') {
+      (*i)++;
+      part[len++] = lval_str_unescape(s[*i]);
     } else {
-      lval_add(x, y);
+      part[len++] = s[*i];
     }
+    (*i)++;
   }
-
-  /* Move past end character */
+  part[len] = '\0';
+  
+  /* Move forward past final " character */
   (*i)++;
   
+  lval* x = malloc(sizeof(lval));
+  x->type = LVAL_STR;
+  x->str = part;
   return x;
-
 }
 
-lval* lval_read(char* s, int* i) {
-  
-  /* Skip all trailing whitespace and comments */
-  while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0') {
+void lval_read_skip(char* s, int* i) {
+  /* Skip all whitespace and comments */
+  while (LCHAR_IS(s[*i], LCHAR_SPACE) || s[*i] == ';') {
     if (s[*i] == ';') {
       while (s[*i] != '\n' && s[*i] != '\0') { (*i)++; }
+      if (s[*i] == '\0') { break; }
     }
     (*i)++;
   }
-  
-  lval* x = NULL;
+}
 
-  /* If we reach end of input then we're missing something */
-  if (s[*i] == '\0') {
-    return lval_err("Unexpected end of input");
-  }
-  
-  /* If next character is ( then read S-Expr */
-  else if (s[*i] == '(') {
-    (*i)++;
-    x = lval_read_expr(s, i, ')');
-  }
-  
-  /* If next character is { then read Q-Expr */
-  else if (s[*i] == '{') {
-    (*i)++;
-    x = lval_read_expr(s, i, '}');
-  }
-  
-  /* If next character is part of a symbol then read symbol */
-  else if (strchr(
-    "abcdefghijklmnopqrstuvwxyz"
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-    "0123456789_+-*\\/=<>!&", s[*i])) {
-    x = lval_read_sym(s, i);
-  }
+lval* lval_read_expr(char* s, int* i, char end) {
   
-  /* If next character is " then read string */
-  else if (strchr("\"", s[*i])) {
-    x = lval_read_str(s, i);
-  }
+  /* Stack of expressions which have been opened but not yet closed */
+  int depth = 0;
+  int slots = 64;
+  lval** stack = malloc(sizeof(lval*) * slots);
   
-  /* Encountered some unexpected character */
-  else {
-    x = lval_err("Unexpected character %c", s[*i]);
-  }
+  /* Outermost expression is closed by the given end character */
+  stack[0] = (end == '}') ? lval_qexpr() : lval_sexpr();
   
-  /* Skip all trailing whitespace and comments */
-  while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0') {
-    if (s[*i] == ';') {
-      while (s[*i] != '\n' && s[*i] != '\0') { (*i)++; }
+  while (1) {
+    
+    lval_read_skip(s, i);
+    
+    lval* top = stack[depth];
+    char close = depth == 0 ? end : (top->type == LVAL_QEXPR ? '}' : ')');
+    lval* x = NULL;
+    
+    /* If next character closes the innermost expression then pop it */
+    if (s[*i] == close) {
+      (*i)++;
+      if (depth == 0) { free(stack); return top; }
+      depth--;
+      lval_add(stack[depth], top);
+      continue;
     }
-    (*i)++;
+    
+    /* If we reach end of input then we're missing something */
+    else if (s[*i] == '\0') {
+      x = lval_err("Unexpected end of input");
+    }
+    
+    /* If next character is ( or { then open a new S-Expr or Q-Expr */
+    else if (s[*i] == '(' || s[*i] == '{') {
+      x = (s[*i] == '{') ? lval_qexpr() : lval_sexpr();
+      (*i)++;
+      depth++;
+      if (depth == slots) {
+        slots *= 2;
+        stack = realloc(stack, sizeof(lval*) * slots);
+      }
+      stack[depth] = x;
+      continue;
+    }
+    
+    /* If next character is part of a symbol then read symbol */
+    else if (LCHAR_IS(s[*i], LCHAR_SYM)) {
+      x = lval_read_sym(s, i);
+    }
+    
+    /* If next character is " then read string */
+    else if (s[*i] == '"') {
+      x = lval_read_str(s, i);
+    }
+    
+    /* Encountered some unexpected character */
+    else {
+      x = lval_err("Unexpected character %c", s[*i]);
+    }
+    
+    /* If an error then delete all open expressions and stop */
+    if (x->type == LVAL_ERR) {
+      for (int j = 0; j <= depth; j++) { lval_del(stack[j]); }
+      free(stack);
+      return x;
+    }
+    
+    lval_add(top, x);
   }
-  
-  return x;
-  
+
 }
 
 /* Main */    
 
 int main(int argc, char** argv) {
   
+  lval_read_init();
+  
   lenv* e = lenv_new();
   lenv_add_builtins(e);
   
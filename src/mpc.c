@@ -55,6 +55,13 @@ static mpc_state_t mpc_state_new(void) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** When the whole of a file is wanted, as in
+** `mpc_parse_contents`, the file is instead
+** read into memory with a single bulk read and
+** handed over as a String input. This avoids
+** calling `fgetc` and `fseek` for every
+** character that is peeked or rewound.
+**
 */
 
 enum {
@@ -80,6 +87,7 @@ typedef struct {
   int type;
   char *filename;
   mpc_state_t state;
+  long offset;
 
   char *string;
   char *buffer;
@@ -95,6 +103,7 @@ typedef struct {
   char last;
 
   size_t mem_index;
+  size_t mem_used;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
@@ -109,6 +118,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->type = MPC_INPUT_STRING;
 
   i->state = mpc_state_new();
+  i->offset = 0;
 
   i->string = malloc(strlen(string) + 1);
   strcpy(i->string, string);
@@ -124,6 +134,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
@@ -138,6 +149,7 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->type = MPC_INPUT_STRING;
 
   i->state = mpc_state_new();
+  i->offset = 0;
 
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
@@ -154,6 +166,38 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
+  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+
+  return i;
+
+}
+
+static mpc_input_t *mpc_input_new_buffer(const char *filename, char *buffer) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_STRING;
+
+  i->state = mpc_state_new();
+  i->offset = 0;
+
+  i->string = buffer;
+  i->buffer = NULL;
+  i->file = NULL;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
@@ -169,6 +213,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   i->type = MPC_INPUT_PIPE;
   i->state = mpc_state_new();
+  i->offset = 0;
 
   i->string = NULL;
   i->buffer = NULL;
@@ -183,6 +228,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
@@ -197,6 +243,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_FILE;
   i->state = mpc_state_new();
+  i->offset = 0;
 
   i->string = NULL;
   i->buffer = NULL;
@@ -211,6 +258,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
@@ -240,11 +288,15 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
 
   if (n > sizeof(mpc_mem_t)) { return malloc(n); }
 
+  /* Long repetitions hold on to every slot, so don't search a full pool */
+  if (i->mem_used == MPC_INPUT_MEM_NUM) { return malloc(n); }
+
   j = i->mem_index;
   do {
     if (!i->mem_full[i->mem_index]) {
       p = (void*)(i->mem + i->mem_index);
       i->mem_full[i->mem_index] = 1;
+      i->mem_used++;
       i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
       return p;
     }
@@ -265,6 +317,7 @@ static void mpc_free(mpc_input_t *i, void *p) {
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
   i->mem_full[j] = 0;
+  i->mem_used--;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -369,7 +422,7 @@ static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->string[i->state.pos - i->offset];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
 
@@ -392,7 +445,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->string[i->state.pos - i->offset];
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -577,6 +630,25 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+/*
+** Makes an error like those of the parser, for
+** callers which check their input further once
+** it has been parsed.
+*/
+mpc_err_t *mpc_err_expected(const char *filename, mpc_state_t s, const char *expected, char recieved) {
+  mpc_err_t *x = malloc(sizeof(mpc_err_t));
+  x->filename = malloc(strlen(filename) + 1);
+  strcpy(x->filename, filename);
+  x->state = s;
+  x->expected_num = 1;
+  x->expected = malloc(sizeof(char*));
+  x->expected[0] = malloc(strlen(expected) + 1);
+  strcpy(x->expected[0], expected);
+  x->failure = NULL;
+  x->recieved = recieved;
+  return x;
+}
+
 void mpc_err_print(mpc_err_t *x) {
   mpc_err_print_to(x, stdout);
 }
@@ -597,9 +669,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
 
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -629,6 +699,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char char_unescape_buffer[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -653,7 +724,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, char_unescape_buffer));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -951,6 +1022,7 @@ typedef union {
   mpc_pdata_or_t or;
 } mpc_pdata_t;
 
+/* mpc_codegen writes out a copy of these definitions, keep them the same */
 struct mpc_parser_t {
   char *name;
   mpc_pdata_t data;
@@ -970,11 +1042,17 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  l = strlen(xs[0]);
+  for (j = 1; j < n; j++) {
+    k = strlen(xs[j]);
+    memcpy((char*)xs[0] + l, xs[j], k + 1);
+    l += k;
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -1337,6 +1415,38 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+static char *mpc_file_read_all(FILE *f) {
+
+  long start, end;
+  size_t length;
+  char *buffer;
+
+  start = ftell(f);
+  if (start < 0 || fseek(f, 0, SEEK_END) != 0) { return NULL; }
+  end = ftell(f);
+  if (end < start || fseek(f, start, SEEK_SET) != 0) { return NULL; }
+
+  buffer = malloc((size_t)(end - start) + 1);
+  length = fread(buffer, 1, (size_t)(end - start), f);
+  buffer[length] = '\0';
+
+  return buffer;
+}
+
+static int mpc_parse_file_contents(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i;
+  char *buffer = mpc_file_read_all(file);
+
+  /* Not seekable so fall back to reading as a pipe */
+  if (buffer == NULL) { return mpc_parse_pipe(filename, file, p, r); }
+
+  i = mpc_input_new_buffer(filename, buffer);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
@@ -1348,11 +1458,265 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
+  res = mpc_parse_file_contents(filename, f, p, r);
   fclose(f);
   return res;
 }
 
+/*
+** Streaming
+*/
+
+/*
+** A stream accepts input in chunks and emits a
+** result each time the parser `p` matches
+** another complete item at the front of what
+** has been buffered so far.
+**
+** Input which has been consumed is discarded,
+** so memory is bounded by the size of the
+** largest single item rather than the whole
+** input. Positions in results and errors
+** continue on from previous chunks.
+**
+** A match which runs right up to the end of
+** the buffered input might be extended by the
+** next chunk (for example a number or symbol
+** split across two chunks) so it is only
+** emitted once some following character,
+** such as trailing whitespace, has arrived, or
+** once the stream is finished.
+**
+** Likewise a failure at the end of the
+** buffered input is taken to mean that more
+** input is needed. Any other failure is
+** emitted as an error and the rest of the
+** line on which it occured is skipped.
+**
+** A pending item is parsed again from its
+** start on every retry. Retries wait for some
+** whitespace, or for the buffer to double, but
+** an item spanning many lines would still be
+** parsed once per line. Calling
+** `mpc_stream_brackets` with the brackets,
+** quotes and line comment characters of the
+** language makes the stream scan its input
+** for them and only retry once the nesting is
+** back at the top level, outside any quote.
+**
+** A parser which matches empty input would
+** never consume anything, so an empty match is
+** emitted as an error and the line skipped.
+*/
+
+enum {
+  MPC_STREAM_BUFFER_MIN = 256
+};
+
+struct mpc_stream_t {
+  mpc_input_t *input;
+  mpc_parser_t *parser;
+  mpc_dtor_t destructor;
+  mpc_state_t state;
+  size_t length;
+  size_t slots;
+  size_t retry;
+  int finished;
+  char *open;
+  char *close;
+  char *quotes;
+  char *comments;
+  int depth;
+  char quote;
+  int escape;
+  int comment;
+};
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = mpc_input_new_buffer(filename, calloc(1, MPC_STREAM_BUFFER_MIN));
+  s->parser = p;
+  s->destructor = d;
+  s->state = mpc_state_new();
+  s->length = 0;
+  s->slots = MPC_STREAM_BUFFER_MIN;
+  s->retry = 0;
+  s->finished = 0;
+  s->open = NULL;
+  s->close = NULL;
+  s->quotes = NULL;
+  s->comments = NULL;
+  s->depth = 0;
+  s->quote = '\0';
+  s->escape = 0;
+  s->comment = 0;
+  return s;
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s->open);
+  free(s->close);
+  free(s->quotes);
+  free(s->comments);
+  free(s);
+}
+
+static char *mpc_stream_strdup(const char *x) {
+  char *y = malloc(strlen(x) + 1);
+  strcpy(y, x);
+  return y;
+}
+
+void mpc_stream_brackets(mpc_stream_t *s, const char *open, const char *close,
+  const char *quotes, const char *comments) {
+  s->open = mpc_stream_strdup(open);
+  s->close = mpc_stream_strdup(close);
+  s->quotes = mpc_stream_strdup(quotes);
+  s->comments = mpc_stream_strdup(comments);
+}
+
+/* Scan a chunk and return if an item might have ended in it */
+static int mpc_stream_scan(mpc_stream_t *s, const char *chunk, size_t length) {
+
+  size_t j;
+  int ended = 0;
+  char c;
+
+  if (s->open == NULL) {
+    for (j = 0; j < length; j++) {
+      if (isspace((unsigned char)chunk[j])) { return 1; }
+    }
+    return 0;
+  }
+
+  for (j = 0; j < length; j++) {
+    c = chunk[j];
+    if (s->comment) {
+      s->comment = c != '\n' && c != '\r';
+    } else if (s->quote) {
+      if (s->escape) { s->escape = 0; }
+      else if (c == '\\') { s->escape = 1; }
+      else if (c == s->quote) { s->quote = '\0'; }
+    } else if (c != '\0') {
+      if      (strchr(s->quotes, c))   { s->quote = c; }
+      else if (strchr(s->comments, c)) { s->comment = 1; }
+      else if (strchr(s->open, c))     { s->depth++; }
+      else if (strchr(s->close, c))    { s->depth--; }
+    }
+    /* Unmatched closing brackets are left for the parser to report */
+    if (s->depth <= 0 && !s->quote) { s->depth = 0; ended = 1; }
+  }
+
+  return ended;
+}
+
+void mpc_stream_feed(mpc_stream_t *s, const char *chunk, size_t length) {
+
+  if (s->length + length + 1 > s->slots) {
+    s->slots = s->length + length + 1;
+    s->slots += s->slots / 2;
+    s->input->string = realloc(s->input->string, s->slots);
+  }
+
+  memcpy(s->input->string + s->length, chunk, length);
+  s->length += length;
+  s->input->string[s->length] = '\0';
+
+  /* Only retry a pending parse once an item might have ended */
+  if (mpc_stream_scan(s, chunk, length)) { s->retry = 0; }
+  if (s->length >= 2 * s->retry) { s->retry = 0; }
+}
+
+void mpc_stream_finish(mpc_stream_t *s) {
+  s->finished = 1;
+  s->retry = 0;
+}
+
+static void mpc_stream_consume(mpc_stream_t *s, size_t n) {
+
+  size_t j;
+  char *b = s->input->string;
+
+  for (j = 0; j < n; j++) {
+    s->state.pos++;
+    s->state.col++;
+    if (b[j] == '\n') {
+      s->state.col = 0;
+      s->state.row++;
+    }
+  }
+
+  memmove(b, b + n, s->length - n + 1);
+  s->length -= n;
+  s->retry = 0;
+}
+
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r) {
+
+  size_t j, used;
+  int x;
+  mpc_input_t *i = s->input;
+  char *b = i->string;
+
+  /* Leading whitespace is never part of an item */
+  for (j = 0; j < s->length && isspace((unsigned char)b[j]); j++);
+  if (j > 0) { mpc_stream_consume(s, j); }
+
+  if (s->length == 0 || (s->retry && !s->finished)) { return MPC_STREAM_NONE; }
+
+  i->state = s->state;
+  i->offset = s->state.pos;
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->last = '\0';
+
+  x = mpc_parse_input(i, s->parser, r);
+  used = (size_t)(i->state.pos - i->offset);
+
+  /* An empty match would be made again on every call */
+  if (x && used == 0) {
+    s->destructor(r->output);
+    r->error = mpc_err_file(i->filename, "parser matched empty input");
+    r->error->state = s->state;
+    x = 0;
+  }
+
+  if (x) {
+
+    if (!s->finished && used == s->length && !isspace((unsigned char)b[used-1])) {
+      s->retry = s->length;
+      s->destructor(r->output);
+      return MPC_STREAM_NONE;
+    }
+
+    mpc_stream_consume(s, used);
+    return MPC_STREAM_OUTPUT;
+
+  } else {
+
+    used = r->error->state.pos > i->offset
+      ? (size_t)(r->error->state.pos - i->offset) : 0;
+
+    if (!s->finished && used >= s->length) {
+      s->retry = s->length;
+      mpc_err_delete(r->error);
+      return MPC_STREAM_NONE;
+    }
+
+    /* The rest of the line is skipped, so start scanning afresh */
+    while (used < s->length && b[used] != '\n') { used++; }
+    mpc_stream_consume(s, used);
+    s->depth = 0;
+    s->quote = '\0';
+    s->escape = 0;
+    s->comment = 0;
+    return MPC_STREAM_ERROR;
+  }
+
+}
+
 /*
 ** Building a Parser
 */
@@ -1580,20 +1944,39 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   return p;
 }
 
-void mpc_cleanup(int n, ...) {
+static void mpc_cleanup_va(int n, va_list va) {
   int i;
   mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
 
-  va_list va;
-  va_start(va, n);
   for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
   for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
   for (i = 0; i < n; i++) { mpc_delete(list[i]); }
-  va_end(va);
 
   free(list);
 }
 
+/*
+** mpc uses mpc_cleanup_parsers for the parsers it builds internally,
+** as the tag table must outlive them.
+*/
+
+static void mpc_cleanup_parsers(int n, ...) {
+  va_list va;
+  va_start(va, n);
+  mpc_cleanup_va(n, va);
+  va_end(va);
+}
+
+static void mpc_tag_cleanup(void);
+
+void mpc_cleanup(int n, ...) {
+  va_list va;
+  va_start(va, n);
+  mpc_cleanup_va(n, va);
+  va_end(va);
+  mpc_tag_cleanup();
+}
+
 mpc_parser_t *mpc_pass(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_PASS;
@@ -2398,7 +2781,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
     r.output = err_out;
   }
 
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+  mpc_cleanup_parsers(6, RegexEnclose, Regex, Term, Factor, Base, Range);
 
   mpc_optimise(r.output);
 
@@ -2486,9 +2869,23 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **
 
   int i;
   int found;
-  char buff[2];
+  size_t l = 0;
   char *s = x;
-  char *y = calloc(1, 1);
+  char *y;
+
+  /* Measure first so the output is allocated once */
+  while (*s) {
+    found = 0;
+    for (i = 0; output[i]; i++) {
+      if (*s == input[i]) { l += strlen(output[i]); found = 1; break; }
+    }
+    if (!found) { l++; }
+    s++;
+  }
+
+  y = malloc(l + 1);
+  l = 0;
+  s = x;
 
   while (*s) {
 
@@ -2497,24 +2894,20 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **
 
     while (output[i]) {
       if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
+        strcpy(y + l, output[i]);
+        l += strlen(output[i]);
         found = 1;
         break;
       }
       i++;
     }
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+    if (!found) { y[l++] = *s; }
 
     s++;
   }
 
-
+  y[l] = '\0';
   return y;
 }
 
@@ -2522,9 +2915,11 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
 
   int i;
   int found = 0;
-  char buff[2];
+  size_t l = 0;
   char *s = x;
-  char *y = calloc(1, 1);
+
+  /* Unescaping never makes a string longer */
+  char *y = malloc(strlen(x) + 1);
 
   while (*s) {
 
@@ -2534,9 +2929,8 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
     while (output[i]) {
       if ((*(s+0)) == output[i][0] &&
           (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 1 + 1);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
+        /* An escaped null adds nothing, as it always has, since it would end the string */
+        if (input[i]) { y[l++] = input[i]; }
         found = 1;
         s++;
         break;
@@ -2544,16 +2938,13 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char
       i++;
     }
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 1 + 1);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+    if (!found) { y[l++] = *s; }
 
     if (*s == '\0') { break; }
     else { s++; }
   }
 
+  y[l] = '\0';
   return y;
 
 }
@@ -2633,7 +3024,7 @@ mpc_val_t *mpcf_freefold(int n, mpc_val_t **xs) {
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, k;
 
   if (n == 0) { return calloc(1, 1); }
 
@@ -2641,8 +3032,13 @@ mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
 
   xs[0] = realloc(xs[0], l + 1);
 
+  /* Copy to the end directly, strcat would rescan the whole string */
+  l = strlen(xs[0]);
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    k = strlen(xs[i]);
+    memcpy((char*)xs[0] + l, xs[i], k + 1);
+    l += k;
+    free(xs[i]);
   }
 
   return xs[0];
@@ -2869,6 +3265,153 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Tags are interned, so a node's tag points into mpc_tag_names and is
+** not freed with the node. Tag ids index mpc_tag_names, counting from
+** 1. The name table maps a tag to its id, and the join table maps a
+** rule id and a tag to the tag with that rule added in front, so a
+** joined tag is only built the first time a pair is seen. Both tables
+** use 0 for an empty slot and are kept at most half full.
+*/
+
+typedef struct {
+  int rule;
+  const char *tag;
+  int id;
+} mpc_tag_join_t;
+
+static char **mpc_tag_names = NULL;
+static int mpc_tag_names_num = 0;
+static int *mpc_tag_table = NULL;
+static int mpc_tag_table_slots = 0;
+static mpc_tag_join_t *mpc_tag_joins = NULL;
+static int mpc_tag_joins_num = 0;
+static int mpc_tag_joins_slots = 0;
+
+static unsigned long mpc_tag_hash(const char *tag) {
+  unsigned long h = 5381;
+  while (*tag) { h = h * 33 + (unsigned char)*tag++; }
+  return h;
+}
+
+static void mpc_tag_insert(int id) {
+  unsigned long j = mpc_tag_hash(mpc_tag_names[id-1]) & (mpc_tag_table_slots-1);
+  while (mpc_tag_table[j]) { j = (j+1) & (mpc_tag_table_slots-1); }
+  mpc_tag_table[j] = id;
+}
+
+static int mpc_tag_find(const char *tag) {
+
+  int id;
+  unsigned long j;
+
+  if (!mpc_tag_table_slots) { return 0; }
+
+  j = mpc_tag_hash(tag) & (mpc_tag_table_slots-1);
+  while ((id = mpc_tag_table[j])) {
+    if (strcmp(mpc_tag_names[id-1], tag) == 0) { return id; }
+    j = (j+1) & (mpc_tag_table_slots-1);
+  }
+  return 0;
+}
+
+int mpc_tag_id(const char *tag) {
+
+  int i, id = mpc_tag_find(tag);
+  if (id) { return id; }
+
+  mpc_tag_names_num++;
+  mpc_tag_names = realloc(mpc_tag_names, sizeof(char*) * mpc_tag_names_num);
+  mpc_tag_names[mpc_tag_names_num-1] = malloc(strlen(tag) + 1);
+  strcpy(mpc_tag_names[mpc_tag_names_num-1], tag);
+
+  if (mpc_tag_names_num * 2 > mpc_tag_table_slots) {
+    mpc_tag_table_slots = mpc_tag_table_slots ? mpc_tag_table_slots * 2 : 64;
+    free(mpc_tag_table);
+    mpc_tag_table = calloc(mpc_tag_table_slots, sizeof(int));
+    for (i = 1; i < mpc_tag_names_num; i++) { mpc_tag_insert(i); }
+  }
+
+  mpc_tag_insert(mpc_tag_names_num);
+  return mpc_tag_names_num;
+}
+
+const char *mpc_tag_name(int id) {
+  if (id < 1 || id > mpc_tag_names_num) { return NULL; }
+  return mpc_tag_names[id-1];
+}
+
+static char *mpc_tag_intern(const char *tag) {
+  int id = mpc_tag_id(tag);
+  return mpc_tag_names[id-1];
+}
+
+static unsigned long mpc_tag_join_hash(int rule, const char *tag) {
+  return ((unsigned long)rule * 33) ^ ((unsigned long)(size_t)tag >> 3);
+}
+
+static void mpc_tag_join_insert(int rule, const char *tag, int id) {
+  unsigned long j = mpc_tag_join_hash(rule, tag) & (mpc_tag_joins_slots-1);
+  while (mpc_tag_joins[j].id) { j = (j+1) & (mpc_tag_joins_slots-1); }
+  mpc_tag_joins[j].rule = rule;
+  mpc_tag_joins[j].tag = tag;
+  mpc_tag_joins[j].id = id;
+}
+
+static int mpc_tag_join(int rule, const char *tag) {
+
+  int i, id, slots;
+  unsigned long j;
+  char *s;
+  mpc_tag_join_t *old;
+
+  if (mpc_tag_joins_slots) {
+    j = mpc_tag_join_hash(rule, tag) & (mpc_tag_joins_slots-1);
+    while (mpc_tag_joins[j].id) {
+      if (mpc_tag_joins[j].rule == rule
+      &&  mpc_tag_joins[j].tag == tag) { return mpc_tag_joins[j].id; }
+      j = (j+1) & (mpc_tag_joins_slots-1);
+    }
+  }
+
+  s = malloc(strlen(mpc_tag_names[rule-1]) + 1 + strlen(tag) + 1);
+  strcpy(s, mpc_tag_names[rule-1]);
+  strcat(s, "|");
+  strcat(s, tag);
+  id = mpc_tag_id(s);
+  free(s);
+
+  mpc_tag_joins_num++;
+  if (mpc_tag_joins_num * 2 > mpc_tag_joins_slots) {
+    old = mpc_tag_joins;
+    slots = mpc_tag_joins_slots;
+    mpc_tag_joins_slots = slots ? slots * 2 : 64;
+    mpc_tag_joins = calloc(mpc_tag_joins_slots, sizeof(mpc_tag_join_t));
+    for (i = 0; i < slots; i++) {
+      if (old[i].id) { mpc_tag_join_insert(old[i].rule, old[i].tag, old[i].id); }
+    }
+    free(old);
+  }
+
+  mpc_tag_join_insert(rule, tag, id);
+  return id;
+}
+
+static void mpc_tag_cleanup(void) {
+  int i;
+  for (i = 0; i < mpc_tag_names_num; i++) { free(mpc_tag_names[i]); }
+  free(mpc_tag_names);
+  free(mpc_tag_table);
+  free(mpc_tag_joins);
+  mpc_tag_names = NULL;
+  mpc_tag_names_num = 0;
+  mpc_tag_table = NULL;
+  mpc_tag_table_slots = 0;
+  mpc_tag_joins = NULL;
+  mpc_tag_joins_num = 0;
+  mpc_tag_joins_slots = 0;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
@@ -2880,7 +3423,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
 
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 
@@ -2888,7 +3430,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
@@ -2897,8 +3438,8 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = mpc_tag_intern(tag);
+  a->id = 0;
 
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2965,25 +3506,29 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  int rule, id;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  rule = mpc_tag_id(t);
+  if (a->id == 0) { a->id = rule; }
+  id = mpc_tag_join(rule, a->tag);
+  a->tag = mpc_tag_names[id-1];
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  char *s;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  s = malloc((strlen(t)-1) + strlen(a->tag) + 1);
+  memcpy(s, t, strlen(t)-1);
+  strcpy(s + (strlen(t)-1), a->tag);
+  a->tag = mpc_tag_intern(s);
+  free(s);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tag = mpc_tag_intern(t);
+  a->id = 0;
   return a;
 }
 
@@ -3215,6 +3760,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
+      if (as[i]->children[0]->id == 0) { as[i]->children[0]->id = as[i]->id; }
       mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
@@ -3563,7 +4109,7 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
     r.output = err_out;
   }
 
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  mpc_cleanup_parsers(5, GrammarTotal, Grammar, Term, Factor, Base);
 
   mpc_optimise(r.output);
 
@@ -3724,7 +4270,7 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
     e = NULL;
   }
 
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  mpc_cleanup_parsers(6, Lang, Stmt, Grammar, Term, Factor, Base);
 
   return e;
 }
@@ -3801,6 +4347,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   mpca_grammar_st_t st;
   mpc_input_t *i;
   mpc_err_t *err;
+  char *buffer;
 
   va_list va;
 
@@ -3818,7 +4365,8 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file(filename, f);
+  buffer = mpc_file_read_all(f);
+  i = buffer ? mpc_input_new_buffer(filename, buffer) : mpc_input_new_file(filename, f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
@@ -4051,3 +4599,374 @@ void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+
+/*
+** Code Generation
+**
+** Writes C source defining a parser, and every parser it uses, as
+** statically initialised structures, so that a program can use a
+** grammar without building it at startup. Each of the n parsers in
+** roots is exported as `<prefix>_<name>`. Functions are written by name, so
+** only those in `mpc_codegen_funcs` may appear in the parser, and
+** pointers to data can only be written for AST tags.
+*/
+
+typedef void(*mpc_codegen_fn_t)(void);
+
+typedef struct {
+  mpc_codegen_fn_t f;
+  const char *name;
+} mpc_codegen_func_t;
+
+#define MPC_CODEGEN_FUNC(f) { (mpc_codegen_fn_t)f, #f }
+
+static const mpc_codegen_func_t mpc_codegen_funcs[] = {
+  MPC_CODEGEN_FUNC(free),
+  MPC_CODEGEN_FUNC(mpc_ast_delete),
+  MPC_CODEGEN_FUNC(mpc_ast_tag),
+  MPC_CODEGEN_FUNC(mpc_ast_add_tag),
+  MPC_CODEGEN_FUNC(mpc_ast_add_root),
+  MPC_CODEGEN_FUNC(mpc_ast_add_root_tag),
+  MPC_CODEGEN_FUNC(mpcf_ctor_null),
+  MPC_CODEGEN_FUNC(mpcf_ctor_str),
+  MPC_CODEGEN_FUNC(mpcf_dtor_null),
+  MPC_CODEGEN_FUNC(mpcf_free),
+  MPC_CODEGEN_FUNC(mpcf_int),
+  MPC_CODEGEN_FUNC(mpcf_hex),
+  MPC_CODEGEN_FUNC(mpcf_oct),
+  MPC_CODEGEN_FUNC(mpcf_float),
+  MPC_CODEGEN_FUNC(mpcf_strtriml),
+  MPC_CODEGEN_FUNC(mpcf_strtrimr),
+  MPC_CODEGEN_FUNC(mpcf_strtrim),
+  MPC_CODEGEN_FUNC(mpcf_escape),
+  MPC_CODEGEN_FUNC(mpcf_escape_regex),
+  MPC_CODEGEN_FUNC(mpcf_escape_string_raw),
+  MPC_CODEGEN_FUNC(mpcf_escape_char_raw),
+  MPC_CODEGEN_FUNC(mpcf_unescape),
+  MPC_CODEGEN_FUNC(mpcf_unescape_regex),
+  MPC_CODEGEN_FUNC(mpcf_unescape_string_raw),
+  MPC_CODEGEN_FUNC(mpcf_unescape_char_raw),
+  MPC_CODEGEN_FUNC(mpcf_null),
+  MPC_CODEGEN_FUNC(mpcf_fst),
+  MPC_CODEGEN_FUNC(mpcf_snd),
+  MPC_CODEGEN_FUNC(mpcf_trd),
+  MPC_CODEGEN_FUNC(mpcf_fst_free),
+  MPC_CODEGEN_FUNC(mpcf_snd_free),
+  MPC_CODEGEN_FUNC(mpcf_trd_free),
+  MPC_CODEGEN_FUNC(mpcf_strfold),
+  MPC_CODEGEN_FUNC(mpcf_maths),
+  MPC_CODEGEN_FUNC(mpcf_str_ast),
+  MPC_CODEGEN_FUNC(mpcf_state_ast),
+  MPC_CODEGEN_FUNC(mpcf_fold_ast),
+  { NULL, NULL }
+};
+
+typedef struct {
+  FILE *f;
+  const char *prefix;
+  int parsers_num;
+  mpc_parser_t **parsers;
+} mpc_codegen_t;
+
+static const char *mpc_codegen_func(mpc_codegen_fn_t f) {
+  int i;
+  for (i = 0; mpc_codegen_funcs[i].name; i++) {
+    if (mpc_codegen_funcs[i].f == f) { return mpc_codegen_funcs[i].name; }
+  }
+  return NULL;
+}
+
+static int mpc_codegen_index(mpc_codegen_t *g, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < g->parsers_num; i++) {
+    if (g->parsers[i] == p) { return i; }
+  }
+  return -1;
+}
+
+/* Number every parser reachable from p */
+static void mpc_codegen_collect(mpc_codegen_t *g, mpc_parser_t *p) {
+
+  int i;
+
+  if (mpc_codegen_index(g, p) != -1) { return; }
+  g->parsers_num++;
+  g->parsers = realloc(g->parsers, sizeof(mpc_parser_t*) * g->parsers_num);
+  g->parsers[g->parsers_num-1] = p;
+
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     mpc_codegen_collect(g, p->data.expect.x); break;
+    case MPC_TYPE_APPLY:      mpc_codegen_collect(g, p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO:   mpc_codegen_collect(g, p->data.apply_to.x); break;
+    case MPC_TYPE_CHECK:      mpc_codegen_collect(g, p->data.check.x); break;
+    case MPC_TYPE_CHECK_WITH: mpc_codegen_collect(g, p->data.check_with.x); break;
+    case MPC_TYPE_PREDICT:    mpc_codegen_collect(g, p->data.predict.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      mpc_codegen_collect(g, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      mpc_codegen_collect(g, p->data.repeat.x); break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_codegen_collect(g, p->data.or.xs[i]); }
+    break;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_codegen_collect(g, p->data.and.xs[i]); }
+    break;
+    default: break;
+  }
+}
+
+static void mpc_codegen_str(mpc_codegen_t *g, const char *s) {
+  if (s == NULL) { fputs("NULL", g->f); return; }
+  fputs("(char*)\"", g->f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fprintf(g->f, "\\%c", *s); }
+    else if (isprint((unsigned char)*s)) { fputc(*s, g->f); }
+    else { fprintf(g->f, "\\%03o", (unsigned char)*s); }
+  }
+  fputc('"', g->f);
+}
+
+static int mpc_codegen_fn(mpc_codegen_t *g, const char *type, mpc_codegen_fn_t f) {
+  const char *name;
+  if (f == NULL) { fputs("NULL", g->f); return 1; }
+  name = mpc_codegen_func(f);
+  if (name == NULL) { return 0; }
+  fprintf(g->f, "(%s)%s", type, name);
+  return 1;
+}
+
+static void mpc_codegen_ref(mpc_codegen_t *g, mpc_parser_t *p) {
+  fprintf(g->f, "&%s_p%i", g->prefix, mpc_codegen_index(g, p));
+}
+
+/* Write the arrays used by parser i, which must come before it */
+static int mpc_codegen_arrays(mpc_codegen_t *g, int i) {
+
+  int j;
+  mpc_parser_t *p = g->parsers[i];
+  FILE *f = g->f;
+
+  if (p->type == MPC_TYPE_OR || p->type == MPC_TYPE_AND) {
+    int n = p->type == MPC_TYPE_OR ? p->data.or.n : p->data.and.n;
+    mpc_parser_t **xs = p->type == MPC_TYPE_OR ? p->data.or.xs : p->data.and.xs;
+    fprintf(f, "static mpc_parser_t *%s_xs%i[] = { ", g->prefix, i);
+    for (j = 0; j < n; j++) {
+      mpc_codegen_ref(g, xs[j]);
+      fputs(j < n-1 ? ", " : " };\n", f);
+    }
+  }
+
+  if (p->type == MPC_TYPE_AND && p->data.and.n > 1) {
+    fprintf(f, "static mpc_dtor_t %s_dxs%i[] = { ", g->prefix, i);
+    for (j = 0; j < p->data.and.n-1; j++) {
+      if (!mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.and.dxs[j])) { return 0; }
+      fputs(j < p->data.and.n-2 ? ", " : " };\n", f);
+    }
+  }
+
+  return 1;
+}
+
+static int mpc_codegen_parser(mpc_codegen_t *g, int i) {
+
+  mpc_parser_t *p = g->parsers[i];
+  FILE *f = g->f;
+  int ok = 1;
+
+  fprintf(f, "static mpc_parser_t %s_p%i = { ", g->prefix, i);
+  mpc_codegen_str(g, p->name);
+  fputs(", ", f);
+
+  switch (p->type) {
+
+    case MPC_TYPE_UNDEFINED: return 0;
+    case MPC_TYPE_FAIL:
+      fputs("{ .fail = { ", f); mpc_codegen_str(g, p->data.fail.m); fputs(" } }", f);
+    break;
+    case MPC_TYPE_LIFT:
+      fputs("{ .lift = { ", f);
+      ok = mpc_codegen_fn(g, "mpc_ctor_t", (mpc_codegen_fn_t)p->data.lift.lf);
+      fputs(", NULL } }", f);
+    break;
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x) { return 0; }
+      fputs("{ .lift = { NULL, NULL } }", f);
+    break;
+    case MPC_TYPE_EXPECT:
+      fputs("{ .expect = { ", f); mpc_codegen_ref(g, p->data.expect.x);
+      fputs(", ", f); mpc_codegen_str(g, p->data.expect.m); fputs(" } }", f);
+    break;
+    case MPC_TYPE_ANCHOR:
+      fputs("{ .anchor = { ", f);
+      ok = mpc_codegen_fn(g, "int(*)(char,char)", (mpc_codegen_fn_t)p->data.anchor.f);
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_SINGLE:
+      fprintf(f, "{ .single = { %i } }", p->data.single.x);
+    break;
+    case MPC_TYPE_RANGE:
+      fprintf(f, "{ .range = { %i, %i } }", p->data.range.x, p->data.range.y);
+    break;
+    case MPC_TYPE_SATISFY:
+      fputs("{ .satisfy = { ", f);
+      ok = mpc_codegen_fn(g, "int(*)(char)", (mpc_codegen_fn_t)p->data.satisfy.f);
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      fputs("{ .string = { ", f); mpc_codegen_str(g, p->data.string.x); fputs(" } }", f);
+    break;
+    case MPC_TYPE_APPLY:
+      fputs("{ .apply = { ", f); mpc_codegen_ref(g, p->data.apply.x); fputs(", ", f);
+      ok = mpc_codegen_fn(g, "mpc_apply_t", (mpc_codegen_fn_t)p->data.apply.f);
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_APPLY_TO:
+      fputs("{ .apply_to = { ", f); mpc_codegen_ref(g, p->data.apply_to.x); fputs(", ", f);
+      ok = mpc_codegen_fn(g, "mpc_apply_to_t", (mpc_codegen_fn_t)p->data.apply_to.f);
+      fputs(", ", f);
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        mpc_codegen_str(g, p->data.apply_to.d);
+      } else if (p->data.apply_to.d == NULL) {
+        fputs("NULL", f);
+      } else {
+        return 0;
+      }
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_CHECK:
+      fputs("{ .check = { ", f); mpc_codegen_ref(g, p->data.check.x); fputs(", ", f);
+      ok = mpc_codegen_fn(g, "mpc_check_t", (mpc_codegen_fn_t)p->data.check.f);
+      fputs(", ", f); mpc_codegen_str(g, p->data.check.e); fputs(" } }", f);
+    break;
+    case MPC_TYPE_CHECK_WITH:
+      if (p->data.check_with.d) { return 0; }
+      fputs("{ .check_with = { ", f); mpc_codegen_ref(g, p->data.check_with.x); fputs(", ", f);
+      ok = mpc_codegen_fn(g, "mpc_check_with_t", (mpc_codegen_fn_t)p->data.check_with.f);
+      fputs(", NULL, ", f); mpc_codegen_str(g, p->data.check_with.e); fputs(" } }", f);
+    break;
+    case MPC_TYPE_PREDICT:
+      fputs("{ .predict = { ", f); mpc_codegen_ref(g, p->data.predict.x); fputs(" } }", f);
+    break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      fputs("{ .not = { ", f); mpc_codegen_ref(g, p->data.not.x); fputs(", ", f);
+      ok = mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.not.dx)
+        && (fputs(", ", f), mpc_codegen_fn(g, "mpc_ctor_t", (mpc_codegen_fn_t)p->data.not.lf));
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      fprintf(f, "{ .repeat = { %i, ", p->data.repeat.n);
+      ok = mpc_codegen_fn(g, "mpc_fold_t", (mpc_codegen_fn_t)p->data.repeat.f);
+      fputs(", ", f); mpc_codegen_ref(g, p->data.repeat.x); fputs(", ", f);
+      ok = ok && mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.repeat.dx);
+      fputs(" } }", f);
+    break;
+    case MPC_TYPE_OR:
+      fprintf(f, "{ .or = { %i, %s_xs%i } }", p->data.or.n, g->prefix, i);
+    break;
+    case MPC_TYPE_AND:
+      fprintf(f, "{ .and = { %i, ", p->data.and.n);
+      ok = mpc_codegen_fn(g, "mpc_fold_t", (mpc_codegen_fn_t)p->data.and.f);
+      fprintf(f, ", %s_xs%i, ", g->prefix, i);
+      if (p->data.and.n > 1) { fprintf(f, "%s_dxs%i", g->prefix, i); } else { fputs("NULL", f); }
+      fputs(" } }", f);
+    break;
+    default:
+      fputs("{ .fail = { NULL } }", f);
+    break;
+  }
+
+  fprintf(f, ", %i, %i };\n", p->type, p->retained);
+  return ok;
+}
+
+/*
+** The generated source needs the layout of mpc_parser_t, so a copy of
+** the definitions above is written out with it. Keep the two the same.
+*/
+static const char *mpc_codegen_types =
+  "typedef struct { char *m; } mpc_pdata_fail_t;\n"
+  "typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;\n"
+  "typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;\n"
+  "typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;\n"
+  "typedef struct { char x; } mpc_pdata_single_t;\n"
+  "typedef struct { char x; char y; } mpc_pdata_range_t;\n"
+  "typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;\n"
+  "typedef struct { char *x; } mpc_pdata_string_t;\n"
+  "typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;\n"
+  "typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;\n"
+  "typedef struct { mpc_parser_t *x; mpc_check_t f; char *e; } mpc_pdata_check_t;\n"
+  "typedef struct { mpc_parser_t *x; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;\n"
+  "typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;\n"
+  "typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;\n"
+  "typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;\n"
+  "typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;\n"
+  "typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;\n"
+  "\n"
+  "typedef union {\n"
+  "  mpc_pdata_fail_t fail;\n"
+  "  mpc_pdata_lift_t lift;\n"
+  "  mpc_pdata_expect_t expect;\n"
+  "  mpc_pdata_anchor_t anchor;\n"
+  "  mpc_pdata_single_t single;\n"
+  "  mpc_pdata_range_t range;\n"
+  "  mpc_pdata_satisfy_t satisfy;\n"
+  "  mpc_pdata_string_t string;\n"
+  "  mpc_pdata_apply_t apply;\n"
+  "  mpc_pdata_apply_to_t apply_to;\n"
+  "  mpc_pdata_check_t check;\n"
+  "  mpc_pdata_check_with_t check_with;\n"
+  "  mpc_pdata_predict_t predict;\n"
+  "  mpc_pdata_not_t not;\n"
+  "  mpc_pdata_repeat_t repeat;\n"
+  "  mpc_pdata_and_t and;\n"
+  "  mpc_pdata_or_t or;\n"
+  "} mpc_pdata_t;\n"
+  "\n"
+  "struct mpc_parser_t {\n"
+  "  char *name;\n"
+  "  mpc_pdata_t data;\n"
+  "  char type;\n"
+  "  char retained;\n"
+  "};\n";
+
+int mpc_codegen(FILE *f, const char *prefix, int n, mpc_parser_t **roots) {
+
+  int i, ok = 1;
+  mpc_codegen_t g;
+
+  g.f = f;
+  g.prefix = prefix;
+  g.parsers_num = 0;
+  g.parsers = NULL;
+
+  for (i = 0; i < n; i++) { mpc_codegen_collect(&g, roots[i]); }
+
+  fprintf(f, "/* Generated by mpc_codegen. Do not edit. */\n\n");
+  fprintf(f, "#include <stdlib.h>\n#include \"mpc.h\"\n\n%s\n", mpc_codegen_types);
+
+  for (i = 0; i < g.parsers_num; i++) {
+    fprintf(f, "static mpc_parser_t %s_p%i;\n", prefix, i);
+  }
+  fputc('\n', f);
+
+  for (i = 0; i < g.parsers_num && ok; i++) {
+    ok = mpc_codegen_arrays(&g, i) && mpc_codegen_parser(&g, i);
+  }
+  fputc('\n', f);
+
+  for (i = 0; i < n && ok; i++) {
+    if (roots[i]->name == NULL) { ok = 0; break; }
+    fprintf(f, "mpc_parser_t *%s_%s = &%s_p%i;\n",
+      prefix, roots[i]->name, prefix, mpc_codegen_index(&g, roots[i]));
+  }
+
+  free(g.parsers);
+  return ok;
+}
@@ -47,6 +47,7 @@ typedef struct {
 } mpc_err_t;
 
 void mpc_err_delete(mpc_err_t *e);
+mpc_err_t *mpc_err_expected(const char *filename, mpc_state_t s, const char *expected, char recieved);
 char *mpc_err_string(mpc_err_t *e);
 void mpc_err_print(mpc_err_t *e);
 void mpc_err_print_to(mpc_err_t *e, FILE *f);
@@ -71,6 +72,19 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Streaming
+*/
+
+enum {
+  MPC_STREAM_NONE   = 0,
+  MPC_STREAM_OUTPUT = 1,
+  MPC_STREAM_ERROR  = 2
+};
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
 /*
 ** Function Types
 */
@@ -85,6 +99,18 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
 
+/*
+** Streaming Parsing
+*/
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_stream_delete(mpc_stream_t *s);
+void mpc_stream_feed(mpc_stream_t *s, const char *chunk, size_t length);
+void mpc_stream_finish(mpc_stream_t *s);
+void mpc_stream_brackets(mpc_stream_t *s, const char *open, const char *close,
+  const char *quotes, const char *comments);
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -280,8 +306,17 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** As well as its tag string, a node has the id of the innermost
+** rule it was tagged with by mpc_ast_add_tag, as mpca_lang does for
+** every rule. Tokens, and roots made by folding, have id 0. The tag
+** string is interned and shared between nodes, so it must not be
+** written to.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
+  int id;
   char *contents;
   mpc_state_t state;
   int children_num;
@@ -306,6 +341,17 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb);
 mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag);
 mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb);
 
+/*
+** Tag names are interned as ids counted up from 1, and mpc_tag_id
+** interns a name it has not seen. Parsing into an AST interns the
+** tags it builds, and interning is not thread safe. mpc_cleanup frees
+** the tag table, so every AST must be deleted before it is called and
+** ids taken before it are not valid after.
+*/
+
+int mpc_tag_id(const char *tag);
+const char *mpc_tag_name(int id);
+
 typedef enum {
   mpc_ast_trav_order_pre,
   mpc_ast_trav_order_post
@@ -372,6 +418,8 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+int mpc_codegen(FILE *f, const char *prefix, int n, mpc_parser_t **roots);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
@@ -0,0 +1,46 @@
+/*
+** mpc_gen - write an mpca_lang grammar out as C
+**
+** Usage: mpc_gen grammar prefix rule...
+**
+** Builds the rules of a grammar file the way mpca_lang does,
+** optimisation included, and writes C source to stdout defining
+** each rule as the parser `<prefix>_<rule>`. Compiled along with
+** mpc.c the parsers are ready to use with no work at startup, and
+** as they are static they must not be deleted or undefined.
+*/
+
+#include "mpc.h"
+
+#define MPC_GEN_MAX 16
+
+int main(int argc, char** argv) {
+  
+  if (argc < 4 || argc - 3 > MPC_GEN_MAX) {
+    fprintf(stderr, "Usage: %s grammar prefix rule...\n", argv[0]);
+    fprintf(stderr, "At most %i rules can be given.\n", MPC_GEN_MAX);
+    return 1;
+  }
+  
+  /* Unused places stay NULL, which ends the list given to mpca_lang */
+  int n = argc - 3;
+  mpc_parser_t* ps[MPC_GEN_MAX] = { NULL };
+  for (int i = 0; i < n; i++) { ps[i] = mpc_new(argv[i+3]); }
+  
+  mpc_err_t* err = mpca_lang_contents(MPCA_LANG_DEFAULT, argv[1],
+    ps[0], ps[1], ps[2],  ps[3],  ps[4],  ps[5],  ps[6],  ps[7],
+    ps[8], ps[9], ps[10], ps[11], ps[12], ps[13], ps[14], ps[15]);
+  
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 1;
+  }
+  
+  if (!mpc_codegen(stdout, argv[2], n, ps)) {
+    fprintf(stderr, "%s: grammar uses a parser which cannot be written as C\n", argv[0]);
+    return 1;
+  }
+  
+  return 0;
+}
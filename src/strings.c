@@ -1,4 +1,11 @@
+/* Expose POSIX signal and timer functions under -std=c99 */
+#define _DEFAULT_SOURCE
+
 #include "mpc.h"
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifdef _WIN32
 
@@ -15,193 +22,519 @@ char* readline(char* prompt) {
 
 void add_history(char* unused) {}
 
+#define LTHREAD __declspec(thread)
+
 #else
 #include <editline/readline.h>
 #include <editline/history.h>
-#endif
-
-/* Parser Declariations */
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-mpc_parser_t* Number; 
-mpc_parser_t* Symbol; 
-mpc_parser_t* String; 
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;  
-mpc_parser_t* Qexpr;  
-mpc_parser_t* Expr; 
-mpc_parser_t* Lispy;
+#define LTHREAD __thread
+#endif
 
 /* Forward Declarations */
 
 struct lval;
 struct lenv;
+struct lfuture;
+struct lseq;
+struct lfile;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lfuture lfuture;
+typedef struct lseq lseq;
+typedef struct lfile lfile;
 
 /* Lisp Value */
 
 enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM, LVAL_STR, 
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUT,
+       LVAL_SEQ, LVAL_FILE };
        
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/*
+** Values read from source keep the place they were read from, as an
+** index into the interned names and a row and column counted from one.
+** A row of 0 means the place is unknown. An error takes the place of
+** the innermost expression it came out of, and on its way out of each
+** function call records a frame with the function and the place of
+** the call, up to LTRACE_MAX frames. Only errors have a place of their
+** own and a trace, so these are kept in an ltrace made with the error.
+*/
+
+#define LTRACE_MAX 16
+
+typedef struct {
+  unsigned int file;
+  unsigned int col;
+  unsigned int row;
+} lloc;
+
+typedef struct {
+  char* name;
+  lloc loc;
+} lframe;
+
+typedef struct {
+  lloc loc;
+  
+  /* Calls, innermost first */
+  lframe* frames;
+  int depth;
+} ltrace;
+
+/* Fields only used by one type of value share the same space */
 struct lval {
   int type;
-
-  /* Basic */
-  long num;
-  char* err;
-  char* sym;
-  char* str;
   
-  /* Function */
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+  /* Where the value was read from */
+  lloc loc;
   
-  /* Expression */
-  int count;
-  lval** cell;
+  union {
+    
+    /* Basic */
+    long num;
+    char* sym;
+    char* str;
+    
+    /* Error */
+    struct {
+      char* err;
+      ltrace* trace;
+    };
+    
+    /* Function */
+    struct {
+      lbuiltin builtin;
+      char* name;
+      lenv* env;
+      lval* formals;
+      lval* body;
+      int macro;
+      int form;
+      int nullary;
+    };
+    
+    /* Future */
+    lfuture* fut;
+    
+    /* Sequence */
+    lseq* seq;
+    
+    /* File */
+    lfile* file;
+    
+    /* Expression */
+    struct {
+      int count;
+      lval** cell;
+      
+      /* Structural hash, or 0 when not yet computed */
+      unsigned long long hash;
+      
+      /* Set once the macro calls in an expression are expanded */
+      int expanded;
+    };
+  };
 };
 
+/*
+** Evaluation limits. Each top level evaluation gets a budget of
+** evaluation steps, allocated bytes and nesting depth, given by the
+** llimit_max_* settings where 0 means unlimited. The budget is reset
+** before the input is read, so the values read take from it too. The
+** allocation functions below take from the byte budget and the matching
+** frees give back to it, so it limits the bytes live at once rather than
+** every byte allocated. lval_eval checks all three, so exceeding one
+** stops evaluation with an error.
+**
+** Deep enough recursion overflows the C stack, so setting any limit
+** also limits depth to LLIMIT_DEPTH_DEFAULT, unless given a depth.
+*/
+
+#define LLIMIT_DEPTH_DEFAULT 10000
+
+/* Unlimited byte budgets leave room for values freed but made before */
+#define LLIMIT_BYTES_NONE (LONG_MAX / 2)
+
+long llimit_max_steps = 0;
+long llimit_max_bytes = 0;
+long llimit_max_depth = 0;
+
+LTHREAD long llimit_steps = LONG_MAX;
+LTHREAD long llimit_bytes = LLIMIT_BYTES_NONE;
+LTHREAD long llimit_depth = LONG_MAX;
+
+void llimit_reset(void) {
+  llimit_steps = llimit_max_steps ? llimit_max_steps : LONG_MAX;
+  llimit_bytes = llimit_max_bytes ? llimit_max_bytes : LLIMIT_BYTES_NONE;
+  llimit_depth = llimit_max_depth ? llimit_max_depth : LONG_MAX;
+}
+
+/*
+** Each thread keeps its own list of free lval structures, so threads
+** evaluating at the same time rarely need to share the system heap.
+** An lval may be freed by a different thread than the one that made it.
+*/
+
+#define LVAL_FREE_MAX 4096
+
+LTHREAD lval* lval_free_list = NULL;
+LTHREAD int lval_free_count = 0;
+
+lval* lval_alloc(void) {
+  llimit_bytes -= sizeof(lval);
+  lval* v = lval_free_list;
+  if (v) {
+    lval_free_list = v->body;
+    lval_free_count--;
+  } else {
+    v = malloc(sizeof(lval));
+  }
+  v->loc = (lloc){ 0, 0, 0 };
+  return v;
+}
+
+void lval_free(lval* v) {
+  llimit_bytes += sizeof(lval);
+  if (lval_free_count < LVAL_FREE_MAX) {
+    v->body = lval_free_list;
+    lval_free_list = v;
+    lval_free_count++;
+  } else {
+    free(v);
+  }
+}
+
+void lval_free_all(void) {
+  while (lval_free_list) {
+    lval* v = lval_free_list;
+    lval_free_list = v->body;
+    free(v);
+  }
+  lval_free_count = 0;
+}
+
+char* lval_alloc_str(size_t n) {
+  llimit_bytes -= n;
+  return malloc(n);
+}
+
+void lval_free_str(char* s) {
+  llimit_bytes += strlen(s) + 1;
+  free(s);
+}
+
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = x;
   return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_ERR;  
+  v->trace = calloc(1, sizeof(ltrace));
   va_list va;
   va_start(va, fmt);  
-  v->err = malloc(512);  
-  vsnprintf(v->err, 511, fmt, va);  
-  v->err = realloc(v->err, strlen(v->err)+1);
+  char buffer[512];
+  vsnprintf(buffer, sizeof(buffer), fmt, va);  
+  v->err = lval_alloc_str(strlen(buffer)+1);
+  strcpy(v->err, buffer);
   va_end(va);  
   return v;
 }
 
+/* Record the call of name at loc on the way out of an error */
+void lval_trace(lval* v, char* name, lloc loc) {
+  ltrace* t = v->trace;
+  if (t->depth++ >= LTRACE_MAX) { return; }
+  t->frames = realloc(t->frames, sizeof(lframe) * t->depth);
+  t->frames[t->depth-1].name = name;
+  t->frames[t->depth-1].loc = loc;
+}
+
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
+  v->sym = lval_alloc_str(strlen(s) + 1);
   strcpy(v->sym, s);
   return v;
 }
 
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
+  v->str = lval_alloc_str(strlen(s) + 1);
   strcpy(v->str, s);
   return v;
 }
 
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->name = NULL;
+  v->macro = 0;
+  v->form = 0;
+  v->nullary = 0;
   return v;
 }
 
 lenv* lenv_new(void);
 
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;  
   v->builtin = NULL;  
+  v->name = NULL;
   v->env = lenv_new();  
   v->formals = formals;
   v->body = body;
+  v->macro = 0;
+  v->form = 0;
+  v->nullary = 0;
   return v;  
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->hash = 0;
+  v->expanded = 0;
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->hash = 0;
+  v->expanded = 0;
   return v;
 }
 
 void lenv_del(lenv* e);
+void lfuture_retain(lfuture* f);
+void lfuture_release(lfuture* f);
+void lseq_retain(lseq* s);
+void lseq_release(lseq* s);
+void lfile_retain(lfile* h);
+void lfile_release(lfile* h);
 
-void lval_del(lval* v) {
+/*
+** Counts of lvals copied and deleted, kept while statistics are enabled.
+** Any thread may update them, so they are only changed atomically.
+*/
+int lstat_enabled = 0;
+long lstat_copies = 0;
+long lstat_copy_bytes = 0;
+long lstat_dels = 0;
+long lstat_del_bytes = 0;
+
+/*
+** Values can be nested deeper than the C stack allows, so the functions
+** walking the whole of a value keep the parts left to visit on a stack
+** of their own. A walk has room for a few parts in place and only moves
+** to the heap for values deeper or wider than that. What the second
+** field of each part means is up to the walk.
+*/
+
+#define LWALK_INLINE 32
+
+typedef struct {
+  lval* x;
+  void* y;
+} lwalk_item;
+
+typedef struct {
+  int count;
+  int slots;
+  lwalk_item* items;
+  lwalk_item inline_items[LWALK_INLINE];
+} lwalk;
+
+void lwalk_init(lwalk* w) {
+  w->count = 0;
+  w->slots = LWALK_INLINE;
+  w->items = w->inline_items;
+}
+
+void lwalk_push(lwalk* w, lval* x, void* y) {
+  if (w->count == w->slots) {
+    w->slots *= 2;
+    if (w->items == w->inline_items) {
+      w->items = malloc(sizeof(lwalk_item) * w->slots);
+      memcpy(w->items, w->inline_items, sizeof(w->inline_items));
+    } else {
+      w->items = realloc(w->items, sizeof(lwalk_item) * w->slots);
+    }
+  }
+  w->items[w->count].x = x;
+  w->items[w->count].y = y;
+  w->count++;
+}
+
+lwalk_item lwalk_pop(lwalk* w) {
+  return w->items[--w->count];
+}
+
+void lwalk_del(lwalk* w) {
+  if (w->items != w->inline_items) { free(w->items); }
+}
 
+/* Bytes owned directly by an lval, not counting its children */
+long lval_bytes(lval* v) {
+  long n = sizeof(lval);
   switch (v->type) {
-    case LVAL_NUM: break;
-    case LVAL_FUN: 
-      if (!v->builtin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
-      }
-    break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
-    case LVAL_QEXPR:
+    case LVAL_ERR: n += strlen(v->err) + 1; break;
+    case LVAL_SYM: n += strlen(v->sym) + 1; break;
+    case LVAL_STR: n += strlen(v->str) + 1; break;
     case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
-      }
-      free(v->cell);
-    break;
+    case LVAL_QEXPR: n += sizeof(lval*) * v->count; break;
+  }
+  return n;
+}
+
+void lval_del(lval* v) {
+
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, v, NULL);
+  
+  while (w.count) {
+    v = lwalk_pop(&w).x;
+    
+    if (lstat_enabled) {
+      __sync_fetch_and_add(&lstat_dels, 1);
+      __sync_fetch_and_add(&lstat_del_bytes, lval_bytes(v));
+    }
+    
+    switch (v->type) {
+      case LVAL_NUM: break;
+      case LVAL_FUN: 
+        if (!v->builtin) {
+          lenv_del(v->env);
+          lwalk_push(&w, v->formals, NULL);
+          lwalk_push(&w, v->body, NULL);
+        }
+      break;
+      case LVAL_ERR:
+        lval_free_str(v->err);
+        free(v->trace->frames);
+        free(v->trace);
+      break;
+      case LVAL_SYM: lval_free_str(v->sym); break;
+      case LVAL_STR: lval_free_str(v->str); break;
+      case LVAL_FUT: lfuture_release(v->fut); break;
+      case LVAL_SEQ: lseq_release(v->seq); break;
+      case LVAL_FILE: lfile_release(v->file); break;
+      case LVAL_QEXPR:
+      case LVAL_SEXPR:
+        for (int i = 0; i < v->count; i++) {
+          lwalk_push(&w, v->cell[i], NULL);
+        }
+        llimit_bytes += sizeof(lval*) * v->count;
+        free(v->cell);
+      break;
+    }
+    
+    lval_free(v);
   }
   
-  free(v);
+  lwalk_del(&w);
 }
 
 lenv* lenv_copy(lenv* e);
 
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
+/* Copy v into x, leaving the parts inside it for the walk to copy */
+void lval_copy_one(lwalk* w, lval* v, lval* x) {
+  if (lstat_enabled) {
+    __sync_fetch_and_add(&lstat_copies, 1);
+    __sync_fetch_and_add(&lstat_copy_bytes, lval_bytes(v));
+  }
   x->type = v->type;
+  x->loc = v->loc;
   switch (v->type) {
     case LVAL_FUN:
+      x->name = v->name;
       if (v->builtin) {
         x->builtin = v->builtin;
       } else {
         x->builtin = NULL;
         x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        lwalk_push(w, v->formals, &x->formals);
+        lwalk_push(w, v->body, &x->body);
       }
+      x->macro = v->macro;
+      x->form = v->form;
+      x->nullary = v->nullary;
     break;
     case LVAL_NUM: x->num = v->num; break;
-    case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
+    case LVAL_ERR: x->err = lval_alloc_str(strlen(v->err) + 1);
       strcpy(x->err, v->err);
+      x->trace = malloc(sizeof(ltrace));
+      *x->trace = *v->trace;
+      if (v->trace->frames) {
+        int n = v->trace->depth < LTRACE_MAX ? v->trace->depth : LTRACE_MAX;
+        x->trace->frames = malloc(sizeof(lframe) * n);
+        memcpy(x->trace->frames, v->trace->frames, sizeof(lframe) * n);
+      }
     break;
-    case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1);
+    case LVAL_SYM: x->sym = lval_alloc_str(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
     break;
-    case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
+    case LVAL_STR: x->str = lval_alloc_str(strlen(v->str) + 1);
       strcpy(x->str, v->str);
     break;
+    case LVAL_FUT: x->fut = v->fut; lfuture_retain(x->fut); break;
+    case LVAL_SEQ: x->seq = v->seq; lseq_retain(x->seq); break;
+    case LVAL_FILE: x->file = v->file; lfile_retain(x->file); break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+      x->hash = v->hash;
+      x->expanded = v->expanded;
       x->count = v->count;
+      llimit_bytes -= sizeof(lval*) * x->count;
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+        lwalk_push(w, v->cell[i], &x->cell[i]);
       }
     break;
   }
+}
+
+/* Each part left to copy is paired with the place its copy goes */
+lval* lval_copy(lval* v) {
+  lval* x;
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, v, &x);
+  while (w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    lval* y = lval_alloc();
+    *(lval**)i.y = y;
+    lval_copy_one(&w, i.x, y);
+  }
+  lwalk_del(&w);
   return x;
 }
 
 lval* lval_add(lval* v, lval* x) {
+  llimit_bytes -= sizeof(lval*);
+  v->hash = 0;
+  v->expanded = 0;
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
@@ -212,13 +545,17 @@ lval* lval_join(lval* x, lval* y) {
   for (int i = 0; i < y->count; i++) {
     x = lval_add(x, y->cell[i]);
   }
+  llimit_bytes += sizeof(lval*) * y->count;
   free(y->cell);
-  free(y);  
+  lval_free(y);  
   return x;
 }
 
 lval* lval_pop(lval* v, int i) {
+  v->hash = 0;
+  v->expanded = 0;
   lval* x = v->cell[i];  
+  llimit_bytes += sizeof(lval*);
   memmove(&v->cell[i],
     &v->cell[i+1], sizeof(lval*) * (v->count-i-1));  
   v->count--;  
@@ -234,73 +571,316 @@ lval* lval_take(lval* v, int i) {
 
 void lval_print(lval* v);
 
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);    
-    if (i != (v->count-1)) {
-      putchar(' ');
+/* Printing goes to stdout unless the current thread redirects it */
+LTHREAD FILE* lval_out = NULL;
+
+FILE* lval_output(void) {
+  return lval_out ? lval_out : stdout;
+}
+
+/*
+** Values are printed into a growable buffer rather than a token at a
+** time. A buffer with an output file is written out whenever it gets
+** large and when printing is done, while one without keeps everything
+** so it can be turned into a string. Strings are escaped as they are
+** copied in, without making an escaped copy first.
+*/
+
+#define LBUF_FLUSH 65536
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  FILE* out;
+} lbuf;
+
+void lbuf_init(lbuf* b, FILE* out) {
+  b->cap = 256;
+  b->len = 0;
+  b->data = malloc(b->cap);
+  b->out = out;
+}
+
+void lbuf_flush(lbuf* b) {
+  if (b->out) { fwrite(b->data, 1, b->len, b->out); b->len = 0; }
+}
+
+void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->out && b->len + n > LBUF_FLUSH) { lbuf_flush(b); }
+  if (b->len + n + 1 > b->cap) {
+    while (b->len + n + 1 > b->cap) { b->cap *= 2; }
+    b->data = realloc(b->data, b->cap);
+  }
+}
+
+void lbuf_putc(lbuf* b, char c) {
+  lbuf_reserve(b, 1);
+  b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, char* s) {
+  size_t n = strlen(s);
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+void lbuf_put_num(lbuf* b, long x) {
+  /* Digits are made backwards from the least significant */
+  char digits[24];
+  int n = 0;
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  do { digits[n++] = '0' + (u % 10); u /= 10; } while (u);
+  if (x < 0) { digits[n++] = '-'; }
+  lbuf_reserve(b, n);
+  while (n) { b->data[b->len++] = digits[--n]; }
+}
+
+void lval_write_expr(lbuf* b, lwalk* w, lval* v, char* open, char* close) {
+  lbuf_puts(b, open);
+  lwalk_push(w, NULL, close);
+  for (int i = v->count-1; i >= 0; i--) {
+    lwalk_push(w, v->cell[i], NULL);
+    if (i) { lwalk_push(w, NULL, " "); }
+  }
+}
+
+void lval_write_str(lbuf* b, lval* v) {
+  /* Escapes match those used by mpcf_escape */
+  lbuf_putc(b, '"');
+  for (char* s = v->str; *s; s++) {
+    switch (*s) {
+      case '\a': lbuf_puts(b, "\\a"); break;
+      case '\b': lbuf_puts(b, "\\b"); break;
+      case '\f': lbuf_puts(b, "\\f"); break;
+      case '\n': lbuf_puts(b, "\\n"); break;
+      case '\r': lbuf_puts(b, "\\r"); break;
+      case '\t': lbuf_puts(b, "\\t"); break;
+      case '\v': lbuf_puts(b, "\\v"); break;
+      case '\\': lbuf_puts(b, "\\\\"); break;
+      case '\'': lbuf_puts(b, "\\'"); break;
+      case '\"': lbuf_puts(b, "\\\""); break;
+      default: lbuf_putc(b, *s);
+    }
+  }
+  lbuf_putc(b, '"');
+}
+
+char* lname_at(int index);
+
+void lval_write_loc(lbuf* b, lloc loc) {
+  lbuf_puts(b, " at ");
+  lbuf_puts(b, loc.file ? lname_at(loc.file) : "?");
+  lbuf_putc(b, ':');
+  lbuf_put_num(b, loc.row);
+  lbuf_putc(b, ':');
+  lbuf_put_num(b, loc.col);
+}
+
+void lval_write_err(lbuf* b, lval* v) {
+  lbuf_puts(b, "Error: ");
+  lbuf_puts(b, v->err);
+  ltrace* t = v->trace;
+  if (t->loc.row) { lval_write_loc(b, t->loc); }
+  
+  int n = t->depth < LTRACE_MAX ? t->depth : LTRACE_MAX;
+  for (int i = 0; i < n; i++) {
+    lbuf_puts(b, "\n  in ");
+    lbuf_puts(b, t->frames[i].name ? t->frames[i].name : "\\");
+    if (t->frames[i].loc.row) { lval_write_loc(b, t->frames[i].loc); }
+  }
+  if (t->depth > n) {
+    lbuf_puts(b, "\n  and ");
+    lbuf_put_num(b, t->depth - n);
+    lbuf_puts(b, " more calls");
+  }
+}
+
+/* Parts without a value are text to write once the parts before are done */
+void lval_write(lbuf* b, lval* v) {
+  
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, v, NULL);
+  
+  while (w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    v = i.x;
+    if (!v) { lbuf_puts(b, i.y); continue; }
+    
+    switch (v->type) {
+      case LVAL_FUN:
+        if (v->builtin) {
+          lbuf_puts(b, "<builtin>");
+        } else {
+          lbuf_puts(b, v->macro ? "(macro " : "(\\ ");
+          lwalk_push(&w, NULL, ")");
+          lwalk_push(&w, v->body, NULL);
+          lwalk_push(&w, NULL, " ");
+          lwalk_push(&w, v->formals, NULL);
+        }
+      break;
+      case LVAL_NUM:   lbuf_put_num(b, v->num); break;
+      case LVAL_ERR:   lval_write_err(b, v); break;
+      case LVAL_SYM:   lbuf_puts(b, v->sym); break;
+      case LVAL_STR:   lval_write_str(b, v); break;
+      case LVAL_SEXPR: lval_write_expr(b, &w, v, "(", ")"); break;
+      case LVAL_QEXPR: lval_write_expr(b, &w, v, "{", "}"); break;
+      case LVAL_FUT:   lbuf_puts(b, "<future>"); break;
+      case LVAL_SEQ:   lbuf_puts(b, "<sequence>"); break;
+      case LVAL_FILE:  lbuf_puts(b, "<file>"); break;
     }
   }
-  putchar(close);
+  
+  lwalk_del(&w);
 }
 
-void lval_print_str(lval* v) {
-  /* Make a Copy of the string */
-  char* escaped = malloc(strlen(v->str)+1);
-  strcpy(escaped, v->str);
-  /* Pass it through the escape function */
-  escaped = mpcf_escape(escaped);
-  /* Print it between " characters */
-  printf("\"%s\"", escaped);
-  /* free the copied string */
-  free(escaped);
+char* lval_to_string(lval* v) {
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_write(&b, v);
+  b.data[b.len] = '\0';
+  return b.data;
 }
 
 void lval_print(lval* v) {
+  lbuf b;
+  lbuf_init(&b, lval_output());
+  lval_write(&b, v);
+  lbuf_flush(&b);
+  free(b.data);
+}
+
+void lval_println(lval* v) {
+  lbuf b;
+  lbuf_init(&b, lval_output());
+  lval_write(&b, v);
+  lbuf_putc(&b, '\n');
+  lbuf_flush(&b);
+  free(b.data);
+}
+
+/*
+** Structural hashes of lists are computed the first time they are
+** needed, by 'hash' or by comparing two lists of the same length, and
+** kept in the lval. A copy keeps the hash of its original. Adding or
+** removing items resets the hash. S-Expressions and Q-Expressions hash
+** alike, so switching between them does not, as lval_eq compares types
+** before hashes anyway. Other values are cheap to hash and some
+** builtins update them in place, so their hashes are never kept.
+*/
+
+#define LHASH_SEED 14695981039346656037ULL
+#define LHASH_PRIME 1099511628211ULL
+
+unsigned long long lhash_mix(unsigned long long h, unsigned long long x) {
+  return (h ^ x) * LHASH_PRIME;
+}
+
+unsigned long long lhash_str(unsigned long long h, char* s) {
+  while (*s) { h = lhash_mix(h, (unsigned char)*s++); }
+  return h;
+}
+
+/* The hash kept by v, or 0 if it has none */
+unsigned long long lhash_kept(lval* v) {
+  return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->hash : 0;
+}
+
+/* Hash v, given the hashes of every list inside it */
+unsigned long long lhash_one(lval* v) {
+  
+  if (lhash_kept(v)) { return v->hash; }
+  
+  int type = v->type == LVAL_QEXPR ? LVAL_SEXPR : v->type;
+  unsigned long long h = lhash_mix(LHASH_SEED, type);
   switch (v->type) {
+    case LVAL_NUM: h = lhash_mix(h, (unsigned long long)v->num); break;
+    case LVAL_ERR: h = lhash_str(h, v->err); break;
+    case LVAL_SYM: h = lhash_str(h, v->sym); break;
+    case LVAL_STR: h = lhash_str(h, v->str); break;
     case LVAL_FUN:
       if (v->builtin) {
-        printf("<builtin>");
+        h = lhash_mix(h, (unsigned long long)(size_t)v->builtin);
       } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        h = lhash_mix(h, lhash_one(v->formals));
+        h = lhash_mix(h, lhash_one(v->body));
       }
     break;
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      h = lhash_mix(h, v->count);
+      for (int i = 0; i < v->count; i++) { h = lhash_mix(h, lhash_one(v->cell[i])); }
+    break;
+    case LVAL_FUT: h = lhash_mix(h, (unsigned long long)(size_t)v->fut); break;
+    case LVAL_SEQ: h = lhash_mix(h, (unsigned long long)(size_t)v->seq); break;
+    case LVAL_FILE: h = lhash_mix(h, (unsigned long long)(size_t)v->file); break;
+  }
+  
+  h = h ? h : 1;
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { v->hash = h; }
+  return h;
+}
+
+/* Push the lists in v still to be hashed, which is v itself if a list */
+void lhash_push(lwalk* w, lval* v) {
+  if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && !v->hash) {
+    lwalk_push(w, v, NULL);
+  } else if (v->type == LVAL_FUN && !v->builtin) {
+    lhash_push(w, v->formals);
+    lhash_push(w, v->body);
   }
 }
 
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+/* Lists are hashed after the lists in them, once they are seen again */
+unsigned long long lval_hash(lval* v) {
+  
+  lwalk w;
+  lwalk_init(&w);
+  lhash_push(&w, v);
+  
+  while (w.count) {
+    lwalk_item* i = &w.items[w.count-1];
+    if (i->y) { w.count--; lhash_one(i->x); continue; }
+    i->y = i->x;
+    lval* x = i->x;
+    for (int j = 0; j < x->count; j++) { lhash_push(&w, x->cell[j]); }
+  }
+  
+  lwalk_del(&w);
+  return lhash_one(v);
+}
 
-int lval_eq(lval* x, lval* y) {
+/* Compare x and y alone, leaving the pairs of parts inside them for later */
+int lval_eq_one(lwalk* w, lval* x, lval* y) {
   
   if (x->type != y->type) { return 0; }
   
+  /* Values with different known hashes cannot be equal */
+  if (lhash_kept(x) && lhash_kept(y) && x->hash != y->hash) { return 0; }
+  
   switch (x->type) {
     case LVAL_NUM: return (x->num == y->num);    
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);    
     case LVAL_STR: return (strcmp(x->str, y->str) == 0);    
+    case LVAL_FUT: return x->fut == y->fut;
+    case LVAL_SEQ: return x->seq == y->seq;
+    case LVAL_FILE: return x->file == y->file;
     case LVAL_FUN: 
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
-        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+        lwalk_push(w, x->body, y->body);
+        lwalk_push(w, x->formals, y->formals);
+        return 1;
       }    
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       if (x->count != y->count) { return 0; }
-      for (int i = 0; i < x->count; i++) {
-        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+      for (int i = x->count-1; i >= 0; i--) {
+        lwalk_push(w, x->cell[i], y->cell[i]);
       }
       return 1;
     break;
@@ -308,6 +888,26 @@ int lval_eq(lval* x, lval* y) {
   return 0;
 }
 
+int lval_eq(lval* x, lval* y) {
+  
+  /* Hashing lists here lets any later comparison of them reject at once */
+  if (x->type == y->type && (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR)
+    && x->count == y->count && lval_hash(x) != lval_hash(y)) {
+    return 0;
+  }
+  
+  lwalk w;
+  lwalk_init(&w);
+  lwalk_push(&w, x, y);
+  int eq = 1;
+  while (eq && w.count) {
+    lwalk_item i = lwalk_pop(&w);
+    eq = lval_eq_one(&w, i.x, i.y);
+  }
+  lwalk_del(&w);
+  return eq;
+}
+
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
@@ -317,49 +917,99 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_FUT: return "Future";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_FILE: return "File";
     default: return "Unknown";
   }
 }
 
 /* Lisp Environment */
 
+/*
+** Once an environment has been checkpointed it keeps a journal of the
+** changes made to it. Each entry holds the index of a binding and the
+** value it had before, or NULL if the binding was added. Rolling back
+** undoes entries until the journal is as long as it was at the
+** checkpoint, so both take time proportional to the changes made,
+** however large the environment is. Committing keeps the changes and
+** empties the journal, as does rolling back to the first checkpoint,
+** and journaling stops until the next checkpoint.
+*/
+
 struct lenv {
   lenv* par;
+  int frozen;
+  int refs;
   int count;
   char** syms;
   lval** vals;
+  
+  /* Journal */
+  int logging;
+  int log_count;
+  int* log_index;
+  lval** log_vals;
 };
 
+/* Bytes a binding takes from the allocation budget, apart from its value */
+long lenv_binding_bytes(char* sym) {
+  return sizeof(char*) + sizeof(lval*) + strlen(sym) + 1;
+}
+
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
   e->par = NULL;
+  e->frozen = 0;
+  e->refs = 0;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->logging = 0;
+  e->log_count = 0;
+  e->log_index = NULL;
+  e->log_vals = NULL;
   return e;
 }
 
+void lenv_release(lenv* e);
+
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
+    llimit_bytes += lenv_binding_bytes(e->syms[i]);
     free(e->syms[i]);
     lval_del(e->vals[i]);
   }  
+  for (int i = 0; i < e->log_count; i++) {
+    if (e->log_vals[i]) { lval_del(e->log_vals[i]); }
+  }
   free(e->syms);
   free(e->vals);
+  free(e->log_index);
+  free(e->log_vals);
+  if (e->par && e->par->refs) { lenv_release(e->par); }
   free(e);
 }
 
 lenv* lenv_copy(lenv* e) {
   lenv* n = malloc(sizeof(lenv));
   n->par = e->par;
+  if (n->par && n->par->refs) { __sync_fetch_and_add(&n->par->refs, 1); }
+  n->frozen = 0;
+  n->refs = 0;
   n->count = e->count;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
+    llimit_bytes -= lenv_binding_bytes(e->syms[i]);
     n->syms[i] = malloc(strlen(e->syms[i]) + 1);
     strcpy(n->syms[i], e->syms[i]);
     n->vals[i] = lval_copy(e->vals[i]);
   }
+  n->logging = 0;
+  n->log_count = 0;
+  n->log_index = NULL;
+  n->log_vals = NULL;
   return n;
 }
 
@@ -376,16 +1026,30 @@ lval* lenv_get(lenv* e, lval* k) {
   }
 }
 
+void lenv_log(lenv* e, int index, lval* old) {
+  e->log_count++;
+  e->log_index = realloc(e->log_index, sizeof(int) * e->log_count);
+  e->log_vals = realloc(e->log_vals, sizeof(lval*) * e->log_count);
+  e->log_index[e->log_count-1] = index;
+  e->log_vals[e->log_count-1] = old;
+}
+
 void lenv_put(lenv* e, lval* k, lval* v) {
   
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
+      if (e->logging) {
+        lenv_log(e, i, e->vals[i]);
+      } else {
+        lval_del(e->vals[i]);
+      }
       e->vals[i] = lval_copy(v);
       return;
     }
   }
   
+  if (e->logging) { lenv_log(e, e->count, NULL); }
+  llimit_bytes -= lenv_binding_bytes(k->sym);
   e->count++;
   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
   e->syms = realloc(e->syms, sizeof(char*) * e->count);  
@@ -394,69 +1058,539 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   strcpy(e->syms[e->count-1], k->sym);
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par) { e = e->par; }
-  lenv_put(e, k, v);
+/* Start journaling and return a checkpoint to roll back to */
+int lenv_checkpoint(lenv* e) {
+  e->logging = 1;
+  return e->log_count;
 }
 
-/* Builtins */
+/* Keep every change made, empty the journal and stop journaling */
+void lenv_commit(lenv* e) {
+  for (int i = 0; i < e->log_count; i++) {
+    if (e->log_vals[i]) { lval_del(e->log_vals[i]); }
+  }
+  free(e->log_index);
+  free(e->log_vals);
+  e->logging = 0;
+  e->log_count = 0;
+  e->log_index = NULL;
+  e->log_vals = NULL;
+}
 
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+void lenv_rollback(lenv* e, int checkpoint) {
+  while (e->log_count > checkpoint) {
+    int i = e->log_index[--e->log_count];
+    lval* old = e->log_vals[e->log_count];
+    if (old) {
+      lval_del(e->vals[i]);
+      e->vals[i] = old;
+    } else {
+      /* Bindings added later were removed first, so this is the last */
+      e->count--;
+      llimit_bytes += lenv_binding_bytes(e->syms[i]);
+      free(e->syms[i]);
+      lval_del(e->vals[i]);
+    }
+  }
+  if (e->log_count == 0) { lenv_commit(e); }
+}
 
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+/* Global definitions go in the outermost environment that is not frozen */
+lenv* lenv_global(lenv* e) {
+  while (e->par && !e->par->frozen) { e = e->par; }
+  return e;
+}
 
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, args->count, num)
+void lenv_def(lenv* e, lval* k, lval* v) {
+  lenv_put(lenv_global(e), k, v);
+}
 
-#define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
-    "Function '%s' passed {} for argument %i.", func, index);
+/*
+** A frozen environment is never changed again, so many threads can
+** read from it at once. Each thread evaluates in its own environment
+** forked from the frozen one, and keeps its definitions there.
+*/
 
-lval* lval_eval(lenv* e, lval* v);
+void lenv_freeze(lenv* e) {
+  e->frozen = 1;
+}
 
-lval* builtin_lambda(lenv* e, lval* a) {
-  LASSERT_NUM("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+lenv* lenv_fork(lenv* e) {
+  lenv* n = lenv_new();
+  n->par = e;
+  return n;
+}
+
+/*
+** Rather than being copied for another thread, the bindings of a global
+** environment are moved into a frozen layer underneath it, and later
+** definitions go in front of them. Layers are reference counted, by
+** the environment above and by each snapshot using them. A layer which
+** only the global environment holds is topped up rather than stacking
+** another on it, as no other thread can see it.
+*/
+
+void lenv_release(lenv* e) {
+  if (__sync_sub_and_fetch(&e->refs, 1) == 0) { lenv_del(e); }
+}
+
+void lenv_share(lenv* g) {
   
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-      "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  if (g->count == 0) { return; }
+  
+  lenv* l = g->par;
+  if (!l || l->refs != 1) {
+    l = lenv_new();
+    l->frozen = 1;
+    l->refs = 1;
+    l->par = g->par;
+    g->par = l;
   }
   
-  lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
-  lval_del(a);
+  for (int i = 0; i < g->count; i++) {
+    int j = 0;
+    while (j < l->count && strcmp(l->syms[j], g->syms[i]) != 0) { j++; }
+    if (j < l->count) {
+      llimit_bytes += lenv_binding_bytes(g->syms[i]);
+      free(g->syms[i]);
+      lval_del(l->vals[j]);
+    } else {
+      l->count++;
+      l->syms = realloc(l->syms, sizeof(char*) * l->count);
+      l->vals = realloc(l->vals, sizeof(lval*) * l->count);
+      l->syms[j] = g->syms[i];
+    }
+    l->vals[j] = g->vals[i];
+  }
   
-  return lval_lambda(formals, body);
+  free(g->syms);
+  free(g->vals);
+  g->count = 0;
+  g->syms = NULL;
+  g->vals = NULL;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
-}
+/*
+** A snapshot holds every binding visible from an environment, up to
+** the first environment frozen for good, for another thread to use
+** while the original carries on changing. Global bindings are shared
+** as above, so only the local environments of calls are copied. While
+** journaling the global environment keeps its bindings where the
+** journal expects them, so they are copied too.
+*/
 
-lval* builtin_head(lenv* e, lval* a) {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
+lenv* lenv_snapshot(lenv* e) {
+  lenv* g = lenv_global(e);
+  if (!g->logging && (!g->par || g->par->frozen == 1)) { lenv_share(g); }
   
-  lval* v = lval_take(a, 0);  
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  lenv* n = lenv_new();
+  for (; e && e->frozen != 1; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      int shadowed = 0;
+      for (int j = 0; j < n->count; j++) {
+        if (strcmp(n->syms[j], e->syms[i]) == 0) { shadowed = 1; break; }
+      }
+      if (shadowed) { continue; }
+      lval* k = lval_sym(e->syms[i]);
+      lenv_put(n, k, e->vals[i]);
+      lval_del(k);
+    }
+  }
+  n->par = e;
+  if (e && e->refs) { __sync_fetch_and_add(&e->refs, 1); }
+  return n;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
+/* Profiling */
+
+/*
+** Function names are interned so a name can be shared by every copy
+** of a function without any further allocation.
+*/
+
+pthread_mutex_t lname_lock = PTHREAD_MUTEX_INITIALIZER;
+int lname_count = 0;
+char** lname_table = NULL;
+
+char* lname_intern(char* name) {
+  pthread_mutex_lock(&lname_lock);
+  char* found = NULL;
+  for (int i = 0; i < lname_count; i++) {
+    if (strcmp(lname_table[i], name) == 0) { found = lname_table[i]; break; }
+  }
+  if (!found) {
+    lname_count++;
+    lname_table = realloc(lname_table, sizeof(char*) * lname_count);
+    found = lname_table[lname_count-1] = malloc(strlen(name) + 1);
+    strcpy(found, name);
+  }
+  pthread_mutex_unlock(&lname_lock);
+  return found;
+}
+
+/* Source file names are interned too, and referred to by index from one */
+int lname_index(char* name) {
+  char* found = lname_intern(name);
+  pthread_mutex_lock(&lname_lock);
+  int index = 0;
+  while (lname_table[index] != found) { index++; }
+  pthread_mutex_unlock(&lname_lock);
+  return index + 1;
+}
+
+char* lname_at(int index) {
+  pthread_mutex_lock(&lname_lock);
+  char* name = lname_table[index-1];
+  pthread_mutex_unlock(&lname_lock);
+  return name;
+}
+
+/*
+** When profiling, every call made by lval_eval_sexpr pushes the name
+** of the function onto a shadow stack. A SIGPROF timer copies the
+** shadow stack into a sample buffer, which is summarised on exit.
+** When not profiling the only cost is a test of lprof_enabled.
+** Every thread has its own shadow stack, and the timer samples
+** whichever thread it interrupts.
+*/
+
+#define LPROF_MAX_DEPTH 65536
+#define LPROF_MAX_SAMPLE 256
+#define LPROF_BUFFER (1 << 22)
+#define LPROF_INTERVAL_US 1000
+
+int lprof_enabled = 0;
+LTHREAD char** lprof_stack = NULL;
+LTHREAD volatile sig_atomic_t lprof_depth = 0;
+
+/* Samples stored as a frame count followed by frames, outermost first */
+char** lprof_samples = NULL;
+volatile sig_atomic_t lprof_used = 0;
+volatile sig_atomic_t lprof_dropped = 0;
+
+void lprof_push(lval* f) {
+  if (!lprof_stack) { lprof_stack = malloc(sizeof(char*) * LPROF_MAX_DEPTH); }
+  int d = lprof_depth;
+  if (d < LPROF_MAX_DEPTH) { lprof_stack[d] = f->name ? f->name : "<lambda>"; }
+  lprof_depth = d + 1;
+}
+
+void lprof_pop(void) { lprof_depth = lprof_depth - 1; }
+
+void lprof_thread_end(void) {
+  char** stack = lprof_stack;
+  lprof_depth = 0;
+  lprof_stack = NULL;
+  free(stack);
+}
+
+void lprof_sample(int sig) {
+  int depth = lprof_depth < LPROF_MAX_DEPTH ? lprof_depth : LPROF_MAX_DEPTH;
+  int start = depth > LPROF_MAX_SAMPLE ? depth - LPROF_MAX_SAMPLE : 0;
+  int n = depth - start;
+  
+  /* Reserve space first, as another thread may be taking a sample too */
+  int used;
+  do {
+    used = lprof_used;
+    if (used + n + 1 > LPROF_BUFFER) { lprof_dropped++; return; }
+  } while (!__sync_bool_compare_and_swap(&lprof_used, used, used + n + 1));
+  
+  lprof_samples[used] = (char*)(size_t)n;
+  for (int i = 0; i < n; i++) {
+    lprof_samples[used + 1 + i] = lprof_stack[start + i];
+  }
+}
+
+void lprof_start(void) {
+#ifdef _WIN32
+  fputs("Profiling is not supported on this platform\n", stderr);
+#else
+  lprof_samples = malloc(sizeof(char*) * LPROF_BUFFER);
+  lprof_enabled = 1;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lprof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  struct itimerval t = {
+    { 0, LPROF_INTERVAL_US },
+    { 0, LPROF_INTERVAL_US } };
+  setitimer(ITIMER_PROF, &t, NULL);
+#endif
+}
+
+int lprof_cmp_folded(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+void lprof_write(char* filename) {
+  
+  if (!lprof_enabled) { return; }
+  
+#ifndef _WIN32
+  struct itimerval t = { { 0, 0 }, { 0, 0 } };
+  setitimer(ITIMER_PROF, &t, NULL);
+  signal(SIGPROF, SIG_IGN);
+#endif
+  lprof_enabled = 0;
+  
+  /* Count self and cumulative samples for every interned name */
+  int total = 0;
+  long toplevel = 0;
+  long* self = calloc(lname_count + 1, sizeof(long));
+  long* cumulative = calloc(lname_count + 1, sizeof(long));
+  int* seen = calloc(lname_count + 1, sizeof(int));
+  char** folded = NULL;
+  
+  for (int i = 0; i < lprof_used; total++) {
+    
+    int n = (int)(size_t)lprof_samples[i];
+    char** frames = lprof_samples + i + 1;
+    i += n + 1;
+    
+    /* Build the folded stack for this sample */
+    size_t len = strlen("<toplevel>") + 1;
+    for (int j = 0; j < n; j++) { len += strlen(frames[j]) + 1; }
+    folded = realloc(folded, sizeof(char*) * (total + 1));
+    folded[total] = malloc(len);
+    strcpy(folded[total], "<toplevel>");
+    for (int j = 0; j < n; j++) {
+      strcat(folded[total], ";");
+      strcat(folded[total], frames[j]);
+    }
+    
+    /* Unnamed functions are counted in the final slot */
+    if (n == 0) { toplevel++; }
+    for (int j = 0; j < n; j++) {
+      int k = 0;
+      while (k < lname_count && lname_table[k] != frames[j]) { k++; }
+      if (seen[k] != total + 1) { seen[k] = total + 1; cumulative[k]++; }
+      if (j == n-1) { self[k]++; }
+    }
+  }
+  
+  FILE* f = fopen(filename, "w");
+  if (f) {
+    fprintf(f, "# samples %i dropped %i interval %ius\n",
+      total, (int)lprof_dropped, LPROF_INTERVAL_US);
+    fprintf(f, "# self cumulative function\n");
+    fprintf(f, "%ld %i <toplevel>\n", toplevel, total);
+    for (int k = 0; k <= lname_count; k++) {
+      if (cumulative[k] == 0) { continue; }
+      fprintf(f, "%ld %ld %s\n", self[k], cumulative[k],
+        k < lname_count ? lname_table[k] : "<lambda>");
+    }
+    fclose(f);
+  }
+  
+  /* Identical stacks are adjacent once sorted */
+  char* folded_name = malloc(strlen(filename) + strlen(".folded") + 1);
+  strcpy(folded_name, filename);
+  strcat(folded_name, ".folded");
+  f = fopen(folded_name, "w");
+  if (f) {
+    qsort(folded, total, sizeof(char*), lprof_cmp_folded);
+    for (int i = 0; i < total;) {
+      int j = i;
+      while (j < total && strcmp(folded[i], folded[j]) == 0) { j++; }
+      fprintf(f, "%s %i\n", folded[i], j - i);
+      i = j;
+    }
+    fclose(f);
+  }
+  
+  for (int i = 0; i < total; i++) { free(folded[i]); }
+  free(folded);
+  free(folded_name);
+  free(self);
+  free(cumulative);
+  free(seen);
+  free(lprof_samples);
+}
+
+/* Statistics */
+
+/*
+** With statistics enabled every builtin registered by lenv_add_builtin
+** counts its calls and the total time spent in them, including any
+** evaluation they perform. Call latencies are also kept in a histogram
+** where bucket i holds calls taking between 2^i and 2^(i+1) ns.
+**
+** Builtins are found from their function through a hash table holding
+** indices into lstat_builtins, counting from 1 so that 0 marks an empty
+** slot. It is kept at most half full, and only changes as builtins are
+** registered, before any thread is started.
+*/
+
+#define LSTAT_BUCKETS 40
+
+typedef struct {
+  char* name;
+  lbuiltin func;
+  long calls;
+  long long ns;
+  long hist[LSTAT_BUCKETS];
+} lstat_builtin;
+
+int lstat_count = 0;
+lstat_builtin* lstat_builtins = NULL;
+int* lstat_table = NULL;
+int lstat_slots = 0;
+
+/* Functions are aligned, so use the high bits which the multiply mixes into */
+unsigned long long lstat_hash(lbuiltin func) {
+  return (lhash_mix(LHASH_SEED, (unsigned long long)(size_t)func) >> 32) & (lstat_slots-1);
+}
+
+lstat_builtin* lstat_find(lbuiltin func) {
+  if (!lstat_slots) { return NULL; }
+  for (unsigned long long j = lstat_hash(func); lstat_table[j]; j = (j+1) & (lstat_slots-1)) {
+    lstat_builtin* s = &lstat_builtins[lstat_table[j]-1];
+    if (s->func == func) { return s; }
+  }
+  return NULL;
+}
+
+void lstat_insert(int index) {
+  unsigned long long j = lstat_hash(lstat_builtins[index-1].func);
+  while (lstat_table[j]) { j = (j+1) & (lstat_slots-1); }
+  lstat_table[j] = index;
+}
+
+void lstat_register(char* name, lbuiltin func) {
+  if (lstat_find(func)) { return; }
+  lstat_count++;
+  lstat_builtins = realloc(lstat_builtins, sizeof(lstat_builtin) * lstat_count);
+  lstat_builtin* s = &lstat_builtins[lstat_count-1];
+  memset(s, 0, sizeof(lstat_builtin));
+  s->name = lname_intern(name);
+  s->func = func;
+  
+  if (lstat_count * 2 > lstat_slots) {
+    lstat_slots = lstat_slots ? lstat_slots * 2 : 128;
+    free(lstat_table);
+    lstat_table = calloc(lstat_slots, sizeof(int));
+    for (int i = 1; i < lstat_count; i++) { lstat_insert(i); }
+  }
+  lstat_insert(lstat_count);
+}
+
+long long lstat_now(void) {
+#ifdef _WIN32
+  return (long long)clock() * (1000000000LL / CLOCKS_PER_SEC);
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+#endif
+}
+
+lval* lstat_call(lenv* e, lval* f, lval* a) {
+  
+  lstat_builtin* s = lstat_find(f->builtin);
+  
+  long long start = lstat_now();
+  lval* r = f->builtin(e, a);
+  long long ns = lstat_now() - start;
+  
+  if (s) {
+    int b = 0;
+    while (b < LSTAT_BUCKETS-1 && (ns >> (b+1)) > 0) { b++; }
+    __sync_fetch_and_add(&s->calls, 1);
+    __sync_fetch_and_add(&s->ns, ns);
+    __sync_fetch_and_add(&s->hist[b], 1);
+  }
+  
+  return r;
+}
+
+void lstat_write(FILE* f) {
+  
+  if (!lstat_enabled) { return; }
+  
+  fprintf(f, "copies %ld\ncopy-bytes %ld\ndels %ld\ndel-bytes %ld\n",
+    lstat_copies, lstat_copy_bytes, lstat_dels, lstat_del_bytes);
+  
+  for (int i = 0; i < lstat_count; i++) {
+    lstat_builtin* s = &lstat_builtins[i];
+    if (s->calls == 0) { continue; }
+    fprintf(f, "builtin %s calls %ld ns %lld hist", s->name, s->calls, s->ns);
+    for (int j = 0; j < LSTAT_BUCKETS; j++) { fprintf(f, " %ld", s->hist[j]); }
+    fputc('\n', f);
+  }
+}
+
+/* Builtins */
+
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+
+#define LASSERT_TYPE(func, args, index, expect) \
+  LASSERT(args, args->cell[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num) \
+  LASSERT(args, args->count == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    func, args->count, num)
+
+#define LASSERT_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->count != 0, \
+    "Function '%s' passed {} for argument %i.", func, index);
+
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_expand(lenv* e, lval* v);
+lval* llimit_error(void);
+
+/* Call f with the argument x, or with x and y, where y is not NULL */
+lval* lval_apply(lenv* e, lval* f, lval* x, lval* y) {
+  lval* expr = lval_add(lval_sexpr(), lval_copy(f));
+  if (y) { lval_add(expr, x); }
+  lval_add(expr, y ? y : x);
+  return lval_eval(e, expr);
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+  LASSERT_NUM("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+  
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+      "Cannot define non-symbol. Got %s, Expected %s.",
+      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_expand(e, lval_pop(a, 0));
+  lval_del(a);
+  
+  if (body->type == LVAL_ERR) { lval_del(formals); return body; }
+  return lval_lambda(formals, body);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("head", a, 0);
+  
+  lval* v = lval_take(a, 0);  
+  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+  return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("tail", a, 0);
 
   lval* v = lval_take(a, 0);  
   lval_del(lval_pop(v, 0));
@@ -543,6 +1677,9 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
     func, syms->count, a->count-1);
     
   for (int i = 0; i < syms->count; i++) {
+    /* Functions take the name they are first bound to */
+    lval* v = a->cell[i+1];
+    if (v->type == LVAL_FUN && !v->name) { v->name = lname_intern(syms->cell[i]->sym); }
     if (strcmp(func, "def") == 0) { lenv_def(e, syms->cell[i], a->cell[i+1]); }
     if (strcmp(func, "=")   == 0) { lenv_put(e, syms->cell[i], a->cell[i+1]); } 
   }
@@ -554,6 +1691,148 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
+/* Macros */
+
+/*
+** A macro is a function marked with the macro flag. It is passed its
+** arguments unevaluated and returns the code to put in place of the
+** call. Macro calls are expanded once, when code is loaded or a
+** function is defined, and expanded expressions are marked so that
+** copies of them are never walked again. Any expression starting with
+** a symbol bound to a macro is expanded, apart from the names given to
+** def, = and \, and the body of defmacro, which builds code rather than
+** running it. Q-Expressions which cannot be evaluated as a call, such
+** as {1 2} or {{a} {b}}, are data and are left as they are.
+*/
+
+int lmacro_count = 0;
+
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* Find the macro bound to sym, without copying it */
+lval* lenv_macro(lenv* e, char* sym) {
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], sym) == 0) {
+        lval* v = e->vals[i];
+        return (v->type == LVAL_FUN && v->macro) ? v : NULL;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Items never expanded, being names or the body of a macro */
+int lval_expand_skip(lval* v, int i) {
+  if (i == 0 || v->cell[0]->type != LVAL_SYM) { return 0; }
+  char* f = v->cell[0]->sym;
+  if (strcmp(f, "defmacro") == 0) { return 1; }
+  return i == 1 && (strcmp(f, "def") == 0
+    || strcmp(f, "=") == 0 || strcmp(f, "\\") == 0);
+}
+
+lval* lval_expand(lenv* e, lval* v) {
+  
+  if (!lmacro_count) { return v; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return v; }
+  if (v->expanded) { return v; }
+  
+  /* Q-Expressions which cannot be evaluated as a call are data */
+  if (v->type == LVAL_QEXPR && v->count
+    && v->cell[0]->type != LVAL_SYM && v->cell[0]->type != LVAL_SEXPR) {
+    return v;
+  }
+  
+  /* Expand macro calls at the head until none are left */
+  lval* m;
+  while (v->count && v->cell[0]->type == LVAL_SYM
+    && (m = lenv_macro(e, v->cell[0]->sym))) {
+    
+    int type = v->type;
+    lval* f = lval_copy(m);
+    lval_del(lval_pop(v, 0));
+    v = lval_call(e, f, v);
+    lval_del(f);
+    
+    /* Code keeps the type of the call, values in a Q-Expression are wrapped */
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      v->type = type;
+    } else if (v->type != LVAL_ERR && type == LVAL_QEXPR) {
+      v = lval_add(lval_qexpr(), v);
+    } else {
+      return v;
+    }
+  }
+  
+  for (int i = 0; i < v->count; i++) {
+    if (lval_expand_skip(v, i)) { continue; }
+    lval* x = v->cell[i];
+    unsigned long long hash = lhash_kept(x);
+    v->cell[i] = lval_expand(e, x);
+    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    /* A rewritten item, however deep, changes the hash of this list too */
+    if (v->cell[i] != x || lhash_kept(v->cell[i]) != hash) { v->hash = 0; }
+  }
+  
+  v->expanded = 1;
+  return v;
+}
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+  LASSERT_NUM("defmacro", a, 2);
+  LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("defmacro", a, 0);
+  LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+  LASSERT(a, (a->cell[0]->cell[0]->type == LVAL_SYM),
+    "Function 'defmacro' cannot define non-symbol. "
+    "Got %s, Expected %s.",
+    ltype_name(a->cell[0]->cell[0]->type), ltype_name(LVAL_SYM));
+  
+  /* The rest is checked and built like the arguments to \ */
+  lval* name = lval_pop(a->cell[0], 0);
+  
+  /* The body builds code rather than running it, so is never expanded */
+  a->cell[1]->expanded = 1;
+  lval* m = builtin_lambda(e, a);
+  if (m->type == LVAL_ERR) { lval_del(name); return m; }
+  
+  m->macro = 1;
+  m->name = lname_intern(name->sym);
+  lenv_def(e, name, m);
+  __sync_fetch_and_add(&lmacro_count, 1);
+  
+  lval_del(name); lval_del(m);
+  return lval_sexpr();
+}
+
+/* Checkpoints apply to the environment which def puts definitions in */
+lval* builtin_checkpoint(lenv* e, lval* a) {
+  LASSERT_NUM("checkpoint", a, 0);
+  lval_del(a);
+  return lval_num(lenv_checkpoint(lenv_global(e)));
+}
+
+lval* builtin_commit(lenv* e, lval* a) {
+  LASSERT_NUM("commit", a, 0);
+  lval_del(a);
+  lenv_commit(lenv_global(e));
+  return lval_sexpr();
+}
+
+lval* builtin_rollback(lenv* e, lval* a) {
+  LASSERT_NUM("rollback", a, 1);
+  LASSERT_TYPE("rollback", a, 0, LVAL_NUM);
+  
+  lenv* g = lenv_global(e);
+  long c = a->cell[0]->num;
+  LASSERT(a, c >= 0 && c <= g->log_count,
+    "Function 'rollback' passed invalid checkpoint %li.", c);
+  
+  lenv_rollback(g, c);
+  lval_del(a);
+  return lval_sexpr();
+}
+
 lval* builtin_ord(lenv* e, lval* a, char* op) {
   LASSERT_NUM(op, a, 2);
   LASSERT_TYPE(op, a, 0, LVAL_NUM);
@@ -585,6 +1864,13 @@ lval* builtin_cmp(lenv* e, lval* a, char* op) {
 lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
 lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
 
+lval* builtin_hash(lenv* e, lval* a) {
+  LASSERT_NUM("hash", a, 1);
+  lval* x = lval_num((long)lval_hash(a->cell[0]));
+  lval_del(a);
+  return x;
+}
+
 lval* builtin_if(lenv* e, lval* a) {
   LASSERT_NUM("if", a, 3);
   LASSERT_TYPE("if", a, 0, LVAL_NUM);
@@ -605,7 +1891,129 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
-lval* lval_read(mpc_ast_t* t);
+/* Evaluate each argument, returning the last, or the empty list if there are none */
+lval* builtin_do(lenv* e, lval* a) {
+  if (a->count == 0) { lval_del(a); return lval_qexpr(); }
+  return lval_take(a, a->count-1);
+}
+
+/* Evaluate the body in a new scope */
+lval* builtin_let(lenv* e, lval* a) {
+  LASSERT_NUM("let", a, 1);
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+  
+  lenv* scope = lenv_new();
+  scope->par = e;
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+  x = lval_eval(scope, x);
+  lenv_del(scope);
+  return x;
+}
+
+/*
+** and and or are forms, so they are given their arguments unevaluated
+** and stop at the first one which decides the result, returning it.
+*/
+lval* builtin_logic(lenv* e, lval* a, char* op) {
+  
+  lval* x = lval_num(strcmp(op, "and") == 0);
+  while (a->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(a, 0));
+    if (x->type == LVAL_ERR) { break; }
+    if (x->type != LVAL_NUM) {
+      lval* err = lval_err("Function '%s' passed incorrect type. "
+        "Got %s, Expected %s.", op, ltype_name(x->type), ltype_name(LVAL_NUM));
+      lval_del(x);
+      x = err;
+      break;
+    }
+    if (strcmp(op, "and") == 0 && !x->num) { break; }
+    if (strcmp(op, "or") == 0 && x->num) { break; }
+  }
+  
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, "and"); }
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, "or"); }
+
+/*
+** Each clause of select and case is a Q-Expression holding a
+** condition or key followed by the code to run when it matches.
+** Only the clauses up to the one which matches are evaluated.
+*/
+#define LASSERT_CLAUSE(func, args, index) \
+  LASSERT(args, args->cell[index]->count == 2, \
+    "Function '%s' passed incorrect clause for argument %i. Got %i items, Expected %i.", \
+    func, index, args->cell[index]->count, 2)
+
+lval* lval_eval_clause(lenv* e, lval* c) {
+  c->type = LVAL_SEXPR;
+  return lval_eval(e, c);
+}
+
+lval* builtin_select(lenv* e, lval* a) {
+  
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+    LASSERT_CLAUSE("select", a, i);
+  }
+  
+  while (a->count) {
+    lval* c = lval_pop(a, 0);
+    lval* x = lval_eval(e, lval_pop(c, 0));
+    if (x->type != LVAL_NUM) {
+      lval* err = x->type == LVAL_ERR ? x : lval_err(
+        "Function 'select' passed incorrect type for condition. "
+        "Got %s, Expected %s.", ltype_name(x->type), ltype_name(LVAL_NUM));
+      if (err != x) { lval_del(x); }
+      lval_del(c); lval_del(a);
+      return err;
+    }
+    if (x->num) {
+      lval_del(x); lval_del(a);
+      return lval_eval_clause(e, c);
+    }
+    lval_del(x); lval_del(c);
+  }
+  
+  lval_del(a);
+  return lval_err("No Selection Found");
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+  
+  LASSERT(a, a->count > 0,
+    "Function 'case' passed incorrect number of arguments. "
+    "Got %i, Expected at least %i.", a->count, 1);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_TYPE("case", a, i, LVAL_QEXPR);
+    LASSERT_CLAUSE("case", a, i);
+  }
+  
+  lval* v = lval_pop(a, 0);
+  while (a->count) {
+    lval* c = lval_pop(a, 0);
+    lval* k = lval_eval(e, lval_pop(c, 0));
+    if (k->type == LVAL_ERR) {
+      lval_del(v); lval_del(c); lval_del(a);
+      return k;
+    }
+    if (lval_eq(v, k)) {
+      lval_del(v); lval_del(k); lval_del(a);
+      return lval_eval_clause(e, c);
+    }
+    lval_del(k); lval_del(c);
+  }
+  
+  lval_del(v); lval_del(a);
+  return lval_err("No Case Found");
+}
+
+int lval_read(char* filename, char* source, mpc_result_t* r);
 
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
@@ -613,15 +2021,14 @@ lval* builtin_load(lenv* e, lval* a) {
   
   /* Parse File given by string name */
   mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+  if (lval_read(a->cell[0]->str, NULL, &r)) {
     
     /* Read contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+    lval* expr = r.output;
 
     /* Evaluate each Expression */
     while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
+      lval* x = lval_eval(e, lval_expand(e, lval_pop(expr, 0)));
       /* If Evaluation leads to error print it */
       if (x->type == LVAL_ERR) { lval_println(x); }
       lval_del(x);
@@ -652,43 +2059,1350 @@ lval* builtin_load(lenv* e, lval* a) {
 lval* builtin_print(lenv* e, lval* a) {
   
   /* Print each argument followed by a space */
+  lbuf b;
+  lbuf_init(&b, lval_output());
   for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+    lval_write(&b, a->cell[i]); lbuf_putc(&b, ' ');
   }
   
   /* Print a newline and delete arguments */
-  putchar('\n');
+  lbuf_putc(&b, '\n');
+  lbuf_flush(&b);
+  free(b.data);
   lval_del(a);
   
   return lval_sexpr();
 }
 
+lval* builtin_to_string(lenv* e, lval* a) {
+  LASSERT_NUM("to-string", a, 1);
+  char* s = lval_to_string(a->cell[0]);
+  lval* x = lval_str(s);
+  free(s);
+  lval_del(a);
+  return x;
+}
+
 lval* builtin_error(lenv* e, lval* a) {
   LASSERT_NUM("error", a, 1);
   LASSERT_TYPE("error", a, 0, LVAL_STR);
   
   /* Construct Error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+  lval* err = lval_err("%s", a->cell[0]->str);
   
   /* Delete arguments and return */
   lval_del(a);
   return err;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+/* Describe a place as the list {file row col} */
+lval* lloc_record(lval* x, lloc loc) {
+  lval_add(x, lval_str(loc.file ? lname_at(loc.file) : ""));
+  lval_add(x, lval_num(loc.row));
+  lval_add(x, lval_num(loc.col));
+  return x;
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* Variable Functions */
-  lenv_add_builtin(e, "\\",  builtin_lambda); 
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=",   builtin_put);
+/*
+** Errors cannot be passed to functions, so try and catch turn them
+** into the list {message file row col trace}, where the trace has a
+** list {name file row col} for each call, innermost first.
+*/
+lval* lval_err_record(lval* err) {
+  lval* x = lval_add(lval_qexpr(), lval_str(err->err));
+  ltrace* t = err->trace;
+  lloc_record(x, t->loc);
   
-  /* List Functions */
+  lval* trace = lval_qexpr();
+  int n = t->depth < LTRACE_MAX ? t->depth : LTRACE_MAX;
+  for (int i = 0; i < n; i++) {
+    lval* frame = lval_add(lval_qexpr(),
+      lval_str(t->frames[i].name ? t->frames[i].name : "\\"));
+    lval_add(trace, lloc_record(frame, t->frames[i].loc));
+  }
+  
+  return lval_add(x, trace);
+}
+
+/* Evaluate the body, passing the record of any error to the handler */
+lval* builtin_try(lenv* e, lval* a) {
+  LASSERT_NUM("try", a, 2);
+  LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("try", a, 1, LVAL_FUN);
+  
+  lval* body = lval_pop(a, 0);
+  body->type = LVAL_SEXPR;
+  lval* x = lval_eval(e, body);
+  if (x->type == LVAL_ERR) {
+    lval* record = lval_err_record(x);
+    lval_del(x);
+    x = lval_apply(e, a->cell[0], record, NULL);
+  }
+  
+  lval_del(a);
+  return x;
+}
+
+/* Evaluate the body, returning the record of its error or {} */
+lval* builtin_catch(lenv* e, lval* a) {
+  LASSERT_NUM("catch", a, 1);
+  LASSERT_TYPE("catch", a, 0, LVAL_QEXPR);
+  
+  lval* body = lval_take(a, 0);
+  body->type = LVAL_SEXPR;
+  lval* x = lval_eval(e, body);
+  if (x->type != LVAL_ERR) {
+    lval_del(x);
+    return lval_qexpr();
+  }
+  
+  lval* record = lval_err_record(x);
+  lval_del(x);
+  return record;
+}
+
+lval* builtin_stats(lenv* e, lval* a) {
+  LASSERT_NUM("stats", a, 0);
+  lval_del(a);
+  
+  /* Memory counts as pairs of name and value */
+  lval* x = lval_qexpr();
+  char* names[] = { "copies", "copy-bytes", "dels", "del-bytes" };
+  long vals[] = { lstat_copies, lstat_copy_bytes, lstat_dels, lstat_del_bytes };
+  for (int i = 0; i < 4; i++) {
+    lval* p = lval_qexpr();
+    lval_add(p, lval_sym(names[i]));
+    lval_add(p, lval_num(vals[i]));
+    lval_add(x, p);
+  }
+  
+  /* Then each builtin which has been called as name, calls, ns, histogram */
+  for (int i = 0; i < lstat_count; i++) {
+    lstat_builtin* s = &lstat_builtins[i];
+    if (s->calls == 0) { continue; }
+    lval* b = lval_qexpr();
+    lval_add(b, lval_str(s->name));
+    lval_add(b, lval_num(s->calls));
+    lval_add(b, lval_num(s->ns));
+    lval* h = lval_qexpr();
+    for (int j = 0; j < LSTAT_BUCKETS; j++) { lval_add(h, lval_num(s->hist[j])); }
+    lval_add(b, h);
+    lval_add(x, b);
+  }
+  
+  return x;
+}
+
+/* Parallel */
+
+/*
+** pmap, pfilter and preduce split a list into chunks which are run on a
+** pool of worker threads. Each worker has a deque of chunks. It takes
+** work from the back of its own deque and, when that is empty, steals
+** from the front of another worker's deque. A thread waiting for its
+** chunks to finish runs queued chunks itself rather than sleeping.
+**
+** While chunks run the calling environment is frozen, and each chunk
+** is evaluated in its own forked environment, so the function should
+** not rely on definitions made by other calls.
+**
+** spawn uses the same pool to evaluate an expression in the background,
+** against a snapshot of the environment, and returns a future. The
+** future is shared by reference counting, and once finished its result
+** is never changed, so await can hand out copies of it to any thread.
+*/
+
+#define LTHREAD_STACK (64 * 1024 * 1024)
+#define LPOOL_GRAIN 32
+
+enum { LPOOL_MAP, LPOOL_FILTER, LPOOL_REDUCE, LPOOL_SPAWN };
+
+typedef struct {
+  int kind;
+  lenv* env;
+  lval* f;
+  lval* items;
+  lval** results;
+  int pending;
+} lpool_job;
+
+typedef struct {
+  lpool_job* job;
+  int start;
+  int end;
+} lpool_task;
+
+struct lfuture {
+  lpool_job job;
+  int refs;
+  lval* result;
+};
+
+void lfuture_retain(lfuture* f) {
+  __sync_fetch_and_add(&f->refs, 1);
+}
+
+void lfuture_release(lfuture* f) {
+  if (__sync_sub_and_fetch(&f->refs, 1) > 0) { return; }
+  if (f->result) { lval_del(f->result); }
+  free(f);
+}
+
+typedef struct {
+  pthread_mutex_t lock;
+  lpool_task* tasks;
+  int head;
+  int tail;
+  int cap;
+} lpool_deque;
+
+int lpool_size = 0;
+int lpool_count = 0;
+int lpool_started = 0;
+lpool_deque* lpool_deques = NULL;
+pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lpool_wake = PTHREAD_COND_INITIALIZER;
+int lpool_queued = 0;
+int lpool_running = 0;
+int lpool_next = 0;
+LTHREAD int lpool_self = -1;
+
+void lpool_push(int w, lpool_task t) {
+  lpool_deque* d = &lpool_deques[w];
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 64;
+    d->tasks = realloc(d->tasks, sizeof(lpool_task) * d->cap);
+  }
+  d->tasks[d->tail++] = t;
+  pthread_mutex_unlock(&d->lock);
+  
+  pthread_mutex_lock(&lpool_lock);
+  lpool_queued++;
+  pthread_cond_broadcast(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+}
+
+/* Take from the back of our own deque, otherwise steal from the front */
+int lpool_take(lpool_task* t) {
+  
+  int first = lpool_self >= 0 ? lpool_self : 0;
+  for (int i = 0; i < lpool_count; i++) {
+    int w = (first + i) % lpool_count;
+    lpool_deque* d = &lpool_deques[w];
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+      *t = (w == lpool_self) ? d->tasks[--d->tail] : d->tasks[d->head++];
+      if (d->head == d->tail) { d->head = d->tail = 0; }
+      found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (found) {
+      pthread_mutex_lock(&lpool_lock);
+      lpool_queued--;
+      lpool_running++;
+      pthread_mutex_unlock(&lpool_lock);
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+void lpool_run(lpool_task t) {
+  
+  lpool_job* j = t.job;
+  lenv* e = lenv_fork(j->env);
+  
+  /*
+  ** Worker threads have a fresh budget for each chunk. A worker waiting
+  ** on a nested job runs chunks in the middle of another, so the budget
+  ** of the outer chunk is put back afterwards.
+  */
+  long steps = llimit_steps, bytes = llimit_bytes, depth = llimit_depth;
+  if (lpool_self >= 0) { llimit_reset(); }
+  
+  if (j->kind == LPOOL_SPAWN) {
+    /* The snapshot and expression belong to this task alone */
+    j->results[0] = builtin_eval(e, lval_add(lval_sexpr(), j->f));
+    j->f = NULL;
+  } else if (j->kind == LPOOL_REDUCE) {
+    /* Fold the chunk from its first item, keeping the first error */
+    lval* x = lval_copy(j->items->cell[t.start]);
+    for (int i = t.start+1; i < t.end && x->type != LVAL_ERR; i++) {
+      x = lval_apply(e, j->f, x, lval_copy(j->items->cell[i]));
+    }
+    j->results[t.start] = x;
+  } else {
+    for (int i = t.start; i < t.end; i++) {
+      j->results[i] = lval_apply(e, j->f, lval_copy(j->items->cell[i]), NULL);
+    }
+  }
+  
+  lenv_del(e);
+  if (lpool_self >= 0) {
+    llimit_steps = steps;
+    llimit_bytes = bytes;
+    llimit_depth = depth;
+  }
+  
+  int spawned = j->kind == LPOOL_SPAWN;
+  if (spawned) { lenv_del(j->env); }
+  
+  pthread_mutex_lock(&lpool_lock);
+  j->pending--;
+  pthread_cond_broadcast(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+  
+  if (spawned) { lfuture_release((lfuture*)j); }
+}
+
+void lpool_run_taken(lpool_task t) {
+  lpool_run(t);
+  pthread_mutex_lock(&lpool_lock);
+  lpool_running--;
+  pthread_cond_broadcast(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+}
+
+/* Wait for every task, including any spawned and never awaited */
+void lpool_finish(void) {
+  pthread_mutex_lock(&lpool_lock);
+  while (lpool_queued > 0 || lpool_running > 0) {
+    pthread_cond_wait(&lpool_wake, &lpool_lock);
+  }
+  pthread_mutex_unlock(&lpool_lock);
+}
+
+void* lpool_worker(void* arg) {
+  lpool_self = (int)(size_t)arg;
+  while (1) {
+    lpool_task t;
+    if (lpool_take(&t)) { lpool_run_taken(t); continue; }
+    pthread_mutex_lock(&lpool_lock);
+    while (lpool_queued == 0) { pthread_cond_wait(&lpool_wake, &lpool_lock); }
+    pthread_mutex_unlock(&lpool_lock);
+  }
+  return NULL;
+}
+
+/* Start the workers the first time they are needed, returning how many */
+int lpool_start(void) {
+  pthread_mutex_lock(&lpool_lock);
+  if (!lpool_deques) {
+#ifdef _WIN32
+    int n = lpool_size ? lpool_size : 1;
+#else
+    int n = lpool_size ? lpool_size : (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    lpool_deques = calloc(n, sizeof(lpool_deque));
+    for (int i = 0; i < n; i++) { pthread_mutex_init(&lpool_deques[i].lock, NULL); }
+    lpool_count = n;
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LTHREAD_STACK);
+    for (int i = 0; i < n; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, &attr, lpool_worker, (void*)(size_t)i) != 0) { break; }
+      pthread_detach(thread);
+      lpool_started++;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  pthread_mutex_unlock(&lpool_lock);
+  return lpool_started;
+}
+
+/* Run queued tasks until a job is done, then sleep until there are more */
+void lpool_wait(lpool_job* j) {
+  while (1) {
+    pthread_mutex_lock(&lpool_lock);
+    int pending = j->pending;
+    pthread_mutex_unlock(&lpool_lock);
+    if (pending == 0) { break; }
+    
+    lpool_task t;
+    if (lpool_take(&t)) { lpool_run_taken(t); continue; }
+    
+    pthread_mutex_lock(&lpool_lock);
+    while (j->pending > 0 && lpool_queued == 0) {
+      pthread_cond_wait(&lpool_wake, &lpool_lock);
+    }
+    pthread_mutex_unlock(&lpool_lock);
+  }
+}
+
+/* Run a job over every item, in chunks on the pool when the list is big enough */
+void lpool_job_run(lpool_job* j) {
+  
+  int count = j->items->count;
+  int workers = count >= 2 * LPOOL_GRAIN && lpool_size != 1 ? lpool_start() : 0;
+  
+  /* Frozen only for now, so a snapshot must not stop here */
+  int frozen = j->env->frozen;
+  if (!frozen) { j->env->frozen = 2; }
+  
+  if (workers <= 1) {
+    lpool_task t = { j, 0, count };
+    j->pending = 1;
+    lpool_run(t);
+  } else {
+    /* Aim for a few chunks per worker so that stealing can even out the load */
+    int chunk = count / (workers * 4);
+    if (chunk < LPOOL_GRAIN) { chunk = LPOOL_GRAIN; }
+    
+    j->pending = (count + chunk - 1) / chunk;
+    for (int i = 0; i < count; i += chunk) {
+      lpool_task t = { j, i, i + chunk < count ? i + chunk : count };
+      int w = lpool_self >= 0 ? lpool_self
+        : __sync_fetch_and_add(&lpool_next, 1) % workers;
+      lpool_push(w, t);
+    }
+    
+    /* Help out until every chunk of this job is done */
+    lpool_wait(j);
+  }
+  
+  j->env->frozen = frozen;
+}
+
+lval* builtin_parallel(lenv* e, lval* a, int kind, char* func) {
+  
+  int list = kind == LPOOL_REDUCE ? 2 : 1;
+  LASSERT_NUM(func, a, list+1);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_TYPE(func, a, list, LVAL_QEXPR);
+  
+  lpool_job j;
+  j.kind = kind;
+  j.env = e;
+  j.f = a->cell[0];
+  j.items = a->cell[list];
+  j.results = calloc(j.items->count, sizeof(lval*));
+  
+  if (j.items->count) { lpool_job_run(&j); }
+  
+  /* Merge results in order, stopping at the first error */
+  lval* x = kind == LPOOL_REDUCE ? lval_pop(a, 1) : lval_qexpr();
+  for (int i = 0; i < j.items->count; i++) {
+    lval* r = j.results[i];
+    if (!r) { continue; }
+    j.results[i] = NULL;
+    
+    if (x->type == LVAL_ERR) { lval_del(r); continue; }
+    if (r->type == LVAL_ERR) { lval_del(x); x = r; continue; }
+    
+    switch (kind) {
+      case LPOOL_MAP: lval_add(x, r); break;
+      case LPOOL_FILTER:
+        if (r->type == LVAL_NUM && r->num) { lval_add(x, lval_copy(j.items->cell[i])); }
+        lval_del(r);
+      break;
+      case LPOOL_REDUCE: x = lval_apply(e, j.f, x, r); break;
+    }
+  }
+  
+  free(j.results);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+  return builtin_parallel(e, a, LPOOL_MAP, "pmap");
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+  return builtin_parallel(e, a, LPOOL_FILTER, "pfilter");
+}
+
+lval* builtin_preduce(lenv* e, lval* a) {
+  return builtin_parallel(e, a, LPOOL_REDUCE, "preduce");
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT_NUM("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+  
+  /* One reference for the returned value and one for the running task */
+  lfuture* f = calloc(1, sizeof(lfuture));
+  f->refs = 2;
+  f->job.kind = LPOOL_SPAWN;
+  f->job.env = lenv_snapshot(e);
+  f->job.f = lval_pop(a, 0);
+  f->job.results = &f->result;
+  f->job.pending = 1;
+  lval_del(a);
+  
+  lpool_task t = { &f->job, 0, 1 };
+  if (lpool_start() > 0) {
+    lpool_push(lpool_self >= 0 ? lpool_self
+      : __sync_fetch_and_add(&lpool_next, 1) % lpool_started, t);
+  } else {
+    lpool_run(t);
+  }
+  
+  lval* v = lval_alloc();
+  v->type = LVAL_FUT;
+  v->fut = f;
+  return v;
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUT);
+  
+  lfuture* f = a->cell[0]->fut;
+  lpool_wait(&f->job);
+  lval* x = lval_copy(f->result);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_is_future(lenv* e, lval* a) {
+  LASSERT_NUM("future?", a, 1);
+  lval* x = lval_num(a->cell[0]->type == LVAL_FUT);
+  lval_del(a);
+  return x;
+}
+
+/* Files */
+
+/*
+** File handles let a program read and write files a line or a chunk at
+** a time, through a stdio buffer of fixed size. Copies of a handle share
+** the same open file, which is closed by close or when the last copy is
+** deleted.
+*/
+
+#define LFILE_BUFFER 65536
+
+struct lfile {
+  int refs;
+  FILE* f;
+};
+
+void lfile_retain(lfile* h) {
+  __sync_fetch_and_add(&h->refs, 1);
+}
+
+void lfile_release(lfile* h) {
+  if (__sync_sub_and_fetch(&h->refs, 1) > 0) { return; }
+  if (h->f) { fclose(h->f); }
+  free(h);
+}
+
+/* Read up to the next newline, which is dropped, or NULL at the end */
+lval* lfile_read_line(FILE* f) {
+  lbuf b;
+  lbuf_init(&b, NULL);
+  int c;
+  while ((c = getc(f)) != EOF && c != '\n') { lbuf_putc(&b, c); }
+  if (c == EOF && b.len == 0) { free(b.data); return NULL; }
+  if (b.len && b.data[b.len-1] == '\r') { b.len--; }
+  b.data[b.len] = '\0';
+  llimit_bytes -= b.len + 1;
+  lval* x = lval_alloc();
+  x->type = LVAL_STR;
+  x->str = realloc(b.data, b.len + 1);
+  return x;
+}
+
+lval* lval_file_closed(char* func) {
+  return lval_err("Function '%s' passed a closed file.", func);
+}
+
+lval* builtin_open(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'open' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", a->count);
+  for (int i = 0; i < a->count; i++) { LASSERT_TYPE("open", a, i, LVAL_STR); }
+  
+  /* Mode is "r", "w" or "a" as for fopen, reading by default */
+  char* mode = a->count == 2 ? a->cell[1]->str : "r";
+  LASSERT(a, strcmp(mode, "r") == 0 || strcmp(mode, "w") == 0 || strcmp(mode, "a") == 0,
+    "Function 'open' passed invalid mode '%s'.", mode);
+  
+  FILE* f = fopen(a->cell[0]->str, mode);
+  if (!f) {
+    lval* err = lval_err("Could not open file %s", a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  setvbuf(f, NULL, _IOFBF, LFILE_BUFFER);
+  
+  lfile* h = malloc(sizeof(lfile));
+  h->refs = 1;
+  h->f = f;
+  lval* v = lval_alloc();
+  v->type = LVAL_FILE;
+  v->file = h;
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_read_line(lenv* e, lval* a) {
+  LASSERT_NUM("read-line", a, 1);
+  LASSERT_TYPE("read-line", a, 0, LVAL_FILE);
+  FILE* f = a->cell[0]->file->f;
+  if (!f) { lval_del(a); return lval_file_closed("read-line"); }
+  
+  /* The end of the file reads as the empty list */
+  lval* x = lfile_read_line(f);
+  lval_del(a);
+  return x ? x : lval_qexpr();
+}
+
+lval* builtin_read_chunk(lenv* e, lval* a) {
+  LASSERT_NUM("read-chunk", a, 2);
+  LASSERT_TYPE("read-chunk", a, 0, LVAL_FILE);
+  LASSERT_TYPE("read-chunk", a, 1, LVAL_NUM);
+  LASSERT(a, a->cell[1]->num > 0,
+    "Function 'read-chunk' passed a size of %li.", a->cell[1]->num);
+  FILE* f = a->cell[0]->file->f;
+  if (!f) { lval_del(a); return lval_file_closed("read-chunk"); }
+  
+  size_t size = a->cell[1]->num;
+  char* chunk = lval_alloc_str(size + 1);
+  size_t n = fread(chunk, 1, size, f);
+  chunk[n] = '\0';
+  
+  lval* x;
+  if (n == 0) {
+    lval_free_str(chunk);
+    x = lval_qexpr();
+  } else {
+    llimit_bytes += size - n;
+    x = lval_alloc();
+    x->type = LVAL_STR;
+    x->str = realloc(chunk, n + 1);
+  }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_write(lenv* e, lval* a) {
+  LASSERT_NUM("write", a, 2);
+  LASSERT_TYPE("write", a, 0, LVAL_FILE);
+  LASSERT_TYPE("write", a, 1, LVAL_STR);
+  FILE* f = a->cell[0]->file->f;
+  if (!f) { lval_del(a); return lval_file_closed("write"); }
+  
+  size_t n = strlen(a->cell[1]->str);
+  if (fwrite(a->cell[1]->str, 1, n, f) != n) {
+    lval_del(a);
+    return lval_err("Could not write to file.");
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_TYPE("close", a, 0, LVAL_FILE);
+  lfile* h = a->cell[0]->file;
+  if (!h->f) { lval_del(a); return lval_file_closed("close"); }
+  
+  int err = fclose(h->f);
+  h->f = NULL;
+  lval_del(a);
+  return err ? lval_err("Could not close file.") : lval_sexpr();
+}
+
+/* Sequences */
+
+/*
+** A sequence is a lazy list. It only describes how to make its items,
+** such as a range of numbers or a function mapped over another
+** sequence, and items are made one at a time as they are asked for. A
+** pipeline of sequences therefore needs memory for one item at a time
+** rather than for every intermediate list.
+**
+** Sequences never change once made, so copies share them by reference
+** counting. Items are made by an iterator, which holds the state of a
+** single pass through a sequence.
+*/
+
+enum { LSEQ_LIST, LSEQ_RANGE, LSEQ_ITERATE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE,
+       LSEQ_LINES };
+
+struct lseq {
+  int refs;
+  int kind;
+  long start;
+  long end;
+  long step;
+  int bounded;
+  lval* f;
+  lval* x;
+  lseq* src;
+};
+
+void lseq_retain(lseq* s) {
+  __sync_fetch_and_add(&s->refs, 1);
+}
+
+void lseq_release(lseq* s) {
+  if (__sync_sub_and_fetch(&s->refs, 1) > 0) { return; }
+  if (s->f) { lval_del(s->f); }
+  if (s->x) { lval_del(s->x); }
+  if (s->src) { lseq_release(s->src); }
+  free(s);
+}
+
+lseq* lseq_new(int kind) {
+  lseq* s = calloc(1, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  return s;
+}
+
+lval* lval_seq(lseq* s) {
+  lval* v = lval_alloc();
+  v->type = LVAL_SEQ;
+  v->seq = s;
+  return v;
+}
+
+/* Sequence functions also take a Q-Expression, as a sequence of its items */
+lseq* lseq_of(lval* v) {
+  if (v->type == LVAL_SEQ) { lseq_retain(v->seq); return v->seq; }
+  lseq* s = lseq_new(LSEQ_LIST);
+  s->x = lval_copy(v);
+  return s;
+}
+
+typedef struct liter {
+  lseq* seq;
+  long n;
+  lval* x;
+  FILE* file;
+  struct liter* src;
+} liter;
+
+liter* liter_new(lseq* s) {
+  liter* it = calloc(1, sizeof(liter));
+  it->seq = s;
+  if (s->kind == LSEQ_RANGE) { it->n = s->start; }
+  if (s->kind == LSEQ_TAKE) { it->n = s->start; }
+  if (s->src) { it->src = liter_new(s->src); }
+  return it;
+}
+
+void liter_del(liter* it) {
+  if (it->x) { lval_del(it->x); }
+  if (it->file) { fclose(it->file); }
+  if (it->src) { liter_del(it->src); }
+  free(it);
+}
+
+/* A sequence is unbounded if some part of it never runs out of items */
+int lseq_bounded(lseq* s) {
+  switch (s->kind) {
+    case LSEQ_RANGE:    return s->bounded;
+    case LSEQ_ITERATE:  return 0;
+    case LSEQ_MAP:
+    case LSEQ_FILTER:   return lseq_bounded(s->src);
+  }
+  return 1;
+}
+
+/* Make the next item, returning NULL at the end or an error if one occurs */
+lval* liter_next(lenv* e, liter* it) {
+  
+  lseq* s = it->seq;
+  switch (s->kind) {
+    
+    case LSEQ_LIST:
+      if (it->n >= s->x->count) { return NULL; }
+      return lval_copy(s->x->cell[it->n++]);
+    
+    case LSEQ_RANGE:
+      if (s->bounded && (s->step > 0 ? it->n >= s->end : it->n <= s->end)) { return NULL; }
+      it->n += s->step;
+      return lval_num(it->n - s->step);
+    
+    case LSEQ_ITERATE:
+      if (!it->x) {
+        it->x = lval_copy(s->x);
+      } else {
+        it->x = lval_apply(e, s->f, it->x, NULL);
+      }
+      return lval_copy(it->x);
+    
+    case LSEQ_MAP: {
+      lval* x = liter_next(e, it->src);
+      if (!x || x->type == LVAL_ERR) { return x; }
+      return lval_apply(e, s->f, x, NULL);
+    }
+    
+    case LSEQ_FILTER:
+      while (1) {
+        lval* x = liter_next(e, it->src);
+        if (!x || x->type == LVAL_ERR) { return x; }
+        lval* r = lval_apply(e, s->f, lval_copy(x), NULL);
+        if (r->type == LVAL_ERR) { lval_del(x); return r; }
+        int keep = r->type == LVAL_NUM && r->num;
+        lval_del(r);
+        if (keep) { return x; }
+        lval_del(x);
+      }
+    
+    case LSEQ_TAKE:
+      if (it->n <= 0) { return NULL; }
+      it->n--;
+      return liter_next(e, it->src);
+    
+    case LSEQ_LINES: {
+      /* A filename is opened for each pass, while a handle is shared */
+      FILE* f;
+      if (s->x->type == LVAL_FILE) {
+        f = s->x->file->f;
+        if (!f) { return lval_file_closed("lines"); }
+      } else {
+        if (!it->file && it->n == 0) {
+          it->n = 1;
+          it->file = fopen(s->x->str, "r");
+          if (!it->file) { return lval_err("Could not open file %s", s->x->str); }
+          setvbuf(it->file, NULL, _IOFBF, LFILE_BUFFER);
+        }
+        f = it->file;
+        if (!f) { return NULL; }
+      }
+      return lfile_read_line(f);
+    }
+  }
+  
+  return NULL;
+}
+
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'range' passed incorrect number of arguments. "
+    "Got %i, Expected 1 to 3.", a->count);
+  for (int i = 0; i < a->count; i++) { LASSERT_TYPE("range", a, i, LVAL_NUM); }
+  LASSERT(a, a->count < 3 || a->cell[2]->num != 0,
+    "Function 'range' passed a step of zero.");
+  
+  /* (range start), (range start end) or (range start end step) */
+  lseq* s = lseq_new(LSEQ_RANGE);
+  s->start = a->cell[0]->num;
+  s->bounded = a->count >= 2;
+  s->end = a->count >= 2 ? a->cell[1]->num : 0;
+  s->step = a->count >= 3 ? a->cell[2]->num : 1;
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_iterate(lenv* e, lval* a) {
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+  
+  lseq* s = lseq_new(LSEQ_ITERATE);
+  s->f = lval_pop(a, 0);
+  s->x = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy(lenv* e, lval* a, int kind, char* func) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+    "Function '%s' passed incorrect type for argument 1. "
+    "Got %s, Expected %s or %s.", func, ltype_name(a->cell[1]->type),
+    ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+  
+  lseq* s = lseq_new(kind);
+  s->src = lseq_of(a->cell[1]);
+  s->f = lval_pop(a, 0);
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_map(lenv* e, lval* a) {
+  return builtin_lazy(e, a, LSEQ_MAP, "lazy-map");
+}
+
+lval* builtin_lazy_filter(lenv* e, lval* a) {
+  return builtin_lazy(e, a, LSEQ_FILTER, "lazy-filter");
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+    "Function 'take' passed incorrect type for argument 1. "
+    "Got %s, Expected %s or %s.", ltype_name(a->cell[1]->type),
+    ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+  
+  long n = a->cell[0]->num > 0 ? a->cell[0]->num : 0;
+  
+  /* Taking from a list gives a list */
+  if (a->cell[1]->type == LVAL_QEXPR) {
+    lval* v = lval_take(a, 1);
+    while (v->count > n) { lval_del(lval_pop(v, v->count-1)); }
+    return v;
+  }
+  
+  lseq* s = lseq_new(LSEQ_TAKE);
+  s->start = n;
+  s->src = lseq_of(a->cell[1]);
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_lines(lenv* e, lval* a) {
+  LASSERT_NUM("lines", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_STR || a->cell[0]->type == LVAL_FILE,
+    "Function 'lines' passed incorrect type for argument 0. "
+    "Got %s, Expected %s or %s.", ltype_name(a->cell[0]->type),
+    ltype_name(LVAL_STR), ltype_name(LVAL_FILE));
+  
+  lseq* s = lseq_new(LSEQ_LINES);
+  s->x = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_realize(lenv* e, lval* a) {
+  LASSERT_NUM("realize", a, 1);
+  if (a->cell[0]->type == LVAL_QEXPR) { return lval_take(a, 0); }
+  LASSERT_TYPE("realize", a, 0, LVAL_SEQ);
+  LASSERT(a, lseq_bounded(a->cell[0]->seq),
+    "Function 'realize' passed an unbounded sequence. Use 'take' first.");
+  
+  liter* it = liter_new(a->cell[0]->seq);
+  lval* v = lval_qexpr();
+  lval* x;
+  while ((x = liter_next(e, it))) {
+    if (x->type == LVAL_ERR) { lval_del(v); v = x; break; }
+    lval_add(v, x);
+    /* Bounded sequences can still be too big for the allocation limit */
+    if (llimit_bytes < 0) { x = llimit_error(); lval_del(v); v = x; break; }
+  }
+  
+  liter_del(it);
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_lazy_fold(lenv* e, lval* a) {
+  LASSERT_NUM("lazy-fold", a, 3);
+  LASSERT_TYPE("lazy-fold", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[2]->type == LVAL_SEQ || a->cell[2]->type == LVAL_QEXPR,
+    "Function 'lazy-fold' passed incorrect type for argument 2. "
+    "Got %s, Expected %s or %s.", ltype_name(a->cell[2]->type),
+    ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+  
+  /* Folds one item at a time, so only the total is ever kept */
+  lseq* s = lseq_of(a->cell[2]);
+  liter* it = liter_new(s);
+  lval* z = lval_pop(a, 1);
+  lval* x;
+  while (z->type != LVAL_ERR && (x = liter_next(e, it))) {
+    if (x->type == LVAL_ERR) { lval_del(z); z = x; break; }
+    z = lval_apply(e, a->cell[0], z, x);
+  }
+  
+  liter_del(it);
+  lseq_release(s);
+  lval_del(a);
+  return z;
+}
+
+/* Images */
+
+/*
+** An image is a binary snapshot of an environment. It starts with
+** the magic bytes "LISPYIMG", a version and the number of bindings,
+** followed by each binding as a name and a value. Every integer is
+** stored little endian at a fixed width and values only refer to
+** what follows them, so loading maps the file and reads it in one
+** pass, with no text to parse or code to evaluate. Values are still
+** rebuilt as new lvals, strings are copied out, and the names of
+** functions are interned again. Builtins are stored by the name
+** they are registered under in lenv_add_builtins, and a flag byte
+** tells builtins, functions and macros apart.
+*/
+
+#define LIMAGE_MAGIC "LISPYIMG"
+#define LIMAGE_VERSION 1
+
+void lenv_add_builtins(lenv* e);
+
+void limage_write_u32(FILE* f, unsigned long x) {
+  for (int i = 0; i < 4; i++) { fputc((x >> (i * 8)) & 0xFF, f); }
+}
+
+void limage_write_i64(FILE* f, long x) {
+  unsigned long long u = (unsigned long long)x;
+  for (int i = 0; i < 8; i++) { fputc((u >> (i * 8)) & 0xFF, f); }
+}
+
+void limage_write_str(FILE* f, char* s) {
+  unsigned long len = strlen(s);
+  limage_write_u32(f, len);
+  fwrite(s, 1, len, f);
+}
+
+char* limage_builtin_name(lenv* builtins, lbuiltin func) {
+  for (int i = 0; i < builtins->count; i++) {
+    if (builtins->vals[i]->builtin == func) { return builtins->syms[i]; }
+  }
+  return NULL;
+}
+
+int limage_write_env(FILE* f, lenv* e, lenv* builtins);
+
+int limage_write_lval(FILE* f, lval* v, lenv* builtins) {
+  fputc(v->type, f);
+  switch (v->type) {
+    case LVAL_NUM: limage_write_i64(f, v->num); break;
+    case LVAL_ERR: limage_write_str(f, v->err); break;
+    case LVAL_SYM: limage_write_str(f, v->sym); break;
+    case LVAL_STR: limage_write_str(f, v->str); break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        char* name = limage_builtin_name(builtins, v->builtin);
+        if (!name) { return 0; }
+        fputc(1, f);
+        limage_write_str(f, name);
+      } else {
+        fputc(v->macro ? 2 : 0, f);
+        if (!limage_write_env(f, v->env, builtins)) { return 0; }
+        if (!limage_write_lval(f, v->formals, builtins)) { return 0; }
+        if (!limage_write_lval(f, v->body, builtins)) { return 0; }
+      }
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      limage_write_u32(f, v->count);
+      for (int i = 0; i < v->count; i++) {
+        if (!limage_write_lval(f, v->cell[i], builtins)) { return 0; }
+      }
+    break;
+    /* Futures, sequences and files belong to a running process and cannot be saved */
+    case LVAL_FUT: return 0;
+    case LVAL_SEQ: return 0;
+    case LVAL_FILE: return 0;
+  }
+  return 1;
+}
+
+int limage_write_env(FILE* f, lenv* e, lenv* builtins) {
+  limage_write_u32(f, e->count);
+  for (int i = 0; i < e->count; i++) {
+    limage_write_str(f, e->syms[i]);
+    if (!limage_write_lval(f, e->vals[i], builtins)) { return 0; }
+  }
+  return 1;
+}
+
+/*
+** A global environment is written with the layers it shares with
+** spawned tasks, innermost last, so that reading the bindings back in
+** order leaves the newest of each.
+*/
+
+int limage_write_global(FILE* f, lenv* e, lenv* builtins) {
+  unsigned long count = 0;
+  for (lenv* l = e; l; l = l->par && l->par->refs ? l->par : NULL) { count += l->count; }
+  limage_write_u32(f, count);
+  
+  int layers = 0;
+  for (lenv* l = e; l; l = l->par && l->par->refs ? l->par : NULL) { layers++; }
+  for (int n = layers; n > 0; n--) {
+    lenv* l = e;
+    for (int i = 1; i < n; i++) { l = l->par; }
+    for (int i = 0; i < l->count; i++) {
+      limage_write_str(f, l->syms[i]);
+      if (!limage_write_lval(f, l->vals[i], builtins)) { return 0; }
+    }
+  }
+  return 1;
+}
+
+typedef struct {
+  unsigned char* data;
+  size_t length;
+  size_t pos;
+  lenv* builtins;
+} limage;
+
+int limage_read_u32(limage* m, unsigned long* x) {
+  if (m->length - m->pos < 4) { return 0; }
+  *x = 0;
+  for (int i = 0; i < 4; i++) { *x |= (unsigned long)m->data[m->pos++] << (i * 8); }
+  return 1;
+}
+
+int limage_read_i64(limage* m, long* x) {
+  if (m->length - m->pos < 8) { return 0; }
+  unsigned long long u = 0;
+  for (int i = 0; i < 8; i++) { u |= (unsigned long long)m->data[m->pos++] << (i * 8); }
+  *x = (long)u;
+  return 1;
+}
+
+char* limage_read_str(limage* m) {
+  unsigned long len;
+  if (!limage_read_u32(m, &len) || m->length - m->pos < len) { return NULL; }
+  char* s = lval_alloc_str(len + 1);
+  memcpy(s, m->data + m->pos, len);
+  s[len] = '\0';
+  m->pos += len;
+  return s;
+}
+
+lenv* limage_read_env(limage* m);
+
+lval* limage_read_lval(limage* m) {
+  
+  if (m->pos == m->length) { return NULL; }
+  
+  lval* v = NULL;
+  int type = m->data[m->pos++];
+  switch (type) {
+    
+    case LVAL_NUM: {
+      long x;
+      if (limage_read_i64(m, &x)) { v = lval_num(x); }
+    } break;
+    
+    case LVAL_ERR:
+    case LVAL_SYM:
+    case LVAL_STR: {
+      char* s = limage_read_str(m);
+      if (!s) { break; }
+      v = lval_alloc();
+      v->type = type;
+      if (type == LVAL_ERR) { v->err = s; v->trace = calloc(1, sizeof(ltrace)); }
+      if (type == LVAL_SYM) { v->sym = s; }
+      if (type == LVAL_STR) { v->str = s; }
+    } break;
+    
+    case LVAL_FUN: {
+      if (m->pos == m->length) { break; }
+      int kind = m->data[m->pos++];
+      if (kind == 1) {
+        char* name = limage_read_str(m);
+        if (!name) { break; }
+        for (int i = 0; i < m->builtins->count; i++) {
+          if (strcmp(m->builtins->syms[i], name) == 0) {
+            v = lval_copy(m->builtins->vals[i]);
+          }
+        }
+        lval_free_str(name);
+      } else {
+        lenv* env = limage_read_env(m);
+        if (!env) { break; }
+        lval* formals = limage_read_lval(m);
+        lval* body = formals ? limage_read_lval(m) : NULL;
+        if (!body) {
+          lenv_del(env);
+          if (formals) { lval_del(formals); }
+          break;
+        }
+        v = lval_lambda(formals, body);
+        lenv_del(v->env);
+        v->env = env;
+        v->macro = (kind == 2);
+        if (v->macro) { __sync_fetch_and_add(&lmacro_count, 1); }
+      }
+    } break;
+    
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+      unsigned long count;
+      if (!limage_read_u32(m, &count)) { break; }
+      v = (type == LVAL_SEXPR) ? lval_sexpr() : lval_qexpr();
+      for (unsigned long i = 0; i < count; i++) {
+        lval* x = limage_read_lval(m);
+        if (!x) { lval_del(v); return NULL; }
+        lval_add(v, x);
+      }
+    } break;
+  }
+  
+  return v;
+}
+
+lenv* limage_read_env(limage* m) {
+  unsigned long count;
+  if (!limage_read_u32(m, &count)) { return NULL; }
+  
+  lenv* e = lenv_new();
+  for (unsigned long i = 0; i < count; i++) {
+    char* sym = limage_read_str(m);
+    lval* val = sym ? limage_read_lval(m) : NULL;
+    if (!val) { if (sym) { lval_free_str(sym); } lenv_del(e); return NULL; }
+    llimit_bytes -= sizeof(char*) + sizeof(lval*);
+    e->count++;
+    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+    e->syms[e->count-1] = sym;
+    e->vals[e->count-1] = val;
+  }
+  return e;
+}
+
+lval* builtin_save_image(lenv* e, lval* a) {
+  LASSERT_NUM("save-image", a, 1);
+  LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+  
+  /*
+  ** Images hold the global environment. When serving, or running with
+  ** --parallel, that is the forked environment of this request or file,
+  ** and never the frozen one shared with other threads.
+  */
+  e = lenv_global(e);
+  
+  FILE* f = fopen(a->cell[0]->str, "wb");
+  if (f == NULL) {
+    lval* err = lval_err("Could not save Image %s", a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  
+  lenv* builtins = lenv_new();
+  lenv_add_builtins(builtins);
+  
+  fwrite(LIMAGE_MAGIC, 1, strlen(LIMAGE_MAGIC), f);
+  limage_write_u32(f, LIMAGE_VERSION);
+  int ok = limage_write_global(f, e, builtins);
+  ok = (fclose(f) == 0) && ok;
+  
+  lenv_del(builtins);
+  
+  if (!ok) {
+    lval* err = lval_err("Could not save Image %s", a->cell[0]->str);
+    remove(a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_load_image(lenv* e, lval* a) {
+  LASSERT_NUM("load-image", a, 1);
+  LASSERT_TYPE("load-image", a, 0, LVAL_STR);
+  
+  /* Map the whole image into memory */
+  limage m;
+#ifdef _WIN32
+  FILE* f = fopen(a->cell[0]->str, "rb");
+  if (f == NULL) {
+    lval* err = lval_err("Could not load Image %s", a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  fseek(f, 0, SEEK_END);
+  m.length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  m.data = malloc(m.length + 1);
+  m.length = fread(m.data, 1, m.length, f);
+  fclose(f);
+#else
+  int fd = open(a->cell[0]->str, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) { close(fd); }
+    lval* err = lval_err("Could not load Image %s", a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  m.length = st.st_size;
+  m.data = m.length ? mmap(NULL, m.length, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (m.data == MAP_FAILED) { m.data = NULL; m.length = 0; }
+#endif
+  m.pos = 0;
+  m.builtins = lenv_new();
+  lenv_add_builtins(m.builtins);
+  
+  /* Check header then read the environment */
+  lenv* img = NULL;
+  unsigned long version = 0;
+  size_t magic = strlen(LIMAGE_MAGIC);
+  if (m.length >= magic && memcmp(m.data, LIMAGE_MAGIC, magic) == 0) {
+    m.pos = magic;
+    if (limage_read_u32(&m, &version) && version == LIMAGE_VERSION) {
+      img = limage_read_env(&m);
+    }
+  }
+  
+#ifdef _WIN32
+  free(m.data);
+#else
+  if (m.data) { munmap(m.data, m.length); }
+#endif
+  lenv_del(m.builtins);
+  
+  if (!img) {
+    lval* err = lval_err("Invalid Image %s", a->cell[0]->str);
+    lval_del(a);
+    return err;
+  }
+  
+  /* Move each binding into the global environment, as def would */
+  e = lenv_global(e);
+  for (int i = 0; i < img->count; i++) {
+    lval* v = img->vals[i];
+    if (v->type == LVAL_FUN && !v->name) { v->name = lname_intern(img->syms[i]); }
+    lval* k = lval_sym(img->syms[i]);
+    lenv_put(e, k, img->vals[i]);
+    lval_del(k);
+  }
+  
+  lenv_del(img);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->name = lname_intern(name);
+  lstat_register(name, func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+/* Forms are builtins which are passed their arguments unevaluated */
+void lenv_add_form(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->name = lname_intern(name);
+  v->form = 1;
+  lstat_register(name, func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+/* Builtins taking no arguments are called on their own, as in (stats) */
+void lenv_add_nullary(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->name = lname_intern(name);
+  v->nullary = 1;
+  lstat_register(name, func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e) {
+  /* Variable Functions */
+  lenv_add_builtin(e, "\\",  builtin_lambda); 
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "=",   builtin_put);
+  lenv_add_builtin(e, "defmacro", builtin_defmacro);
+  lenv_add_nullary(e, "checkpoint", builtin_checkpoint);
+  lenv_add_nullary(e, "commit",     builtin_commit);
+  lenv_add_builtin(e, "rollback",   builtin_rollback);
+  
+  /* List Functions */
   lenv_add_builtin(e, "list", builtin_list);
   lenv_add_builtin(e, "head", builtin_head);
   lenv_add_builtin(e, "tail", builtin_tail);
@@ -703,8 +3417,15 @@ void lenv_add_builtins(lenv* e) {
   
   /* Comparison Functions */
   lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, "do", builtin_do);
+  lenv_add_builtin(e, "let", builtin_let);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case", builtin_case);
+  lenv_add_form(e, "and", builtin_and);
+  lenv_add_form(e, "or",  builtin_or);
   lenv_add_builtin(e, "==", builtin_eq);
   lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "hash", builtin_hash);
   lenv_add_builtin(e, ">",  builtin_gt);
   lenv_add_builtin(e, "<",  builtin_lt);
   lenv_add_builtin(e, ">=", builtin_ge);
@@ -713,14 +3434,52 @@ void lenv_add_builtins(lenv* e) {
   /* String Functions */
   lenv_add_builtin(e, "load",  builtin_load); 
   lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "try",   builtin_try);
+  lenv_add_builtin(e, "catch", builtin_catch);
   lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "to-string", builtin_to_string);
+  
+  /* Image Functions */
+  lenv_add_builtin(e, "save-image", builtin_save_image);
+  lenv_add_builtin(e, "load-image", builtin_load_image);
+  
+  /* Statistics Functions */
+  lenv_add_nullary(e, "stats", builtin_stats);
+  
+  /* Parallel Functions */
+  lenv_add_builtin(e, "pmap",    builtin_pmap);
+  lenv_add_builtin(e, "pfilter", builtin_pfilter);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "spawn",   builtin_spawn);
+  lenv_add_builtin(e, "await",   builtin_await);
+  lenv_add_builtin(e, "future?", builtin_is_future);
+  
+  /* Sequence Functions */
+  lenv_add_builtin(e, "range",       builtin_range);
+  lenv_add_builtin(e, "iterate",     builtin_iterate);
+  lenv_add_builtin(e, "lazy-map",    builtin_lazy_map);
+  lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(e, "lazy-fold",   builtin_lazy_fold);
+  lenv_add_builtin(e, "take",        builtin_take);
+  lenv_add_builtin(e, "realize",     builtin_realize);
+  lenv_add_builtin(e, "lines",       builtin_lines);
+  
+  /* File Functions */
+  lenv_add_builtin(e, "open",       builtin_open);
+  lenv_add_builtin(e, "read-line",  builtin_read_line);
+  lenv_add_builtin(e, "read-chunk", builtin_read_chunk);
+  lenv_add_builtin(e, "write",      builtin_write);
+  lenv_add_builtin(e, "close",      builtin_close);
 }
 
 /* Evaluation */
 
 lval* lval_call(lenv* e, lval* f, lval* a) {
   
-  if (f->builtin) { return f->builtin(e, a); }
+  if (f->builtin) {
+    if (lstat_enabled) { return lstat_call(e, f, a); }
+    return f->builtin(e, a);
+  }
   
   int given = a->count;
   int total = f->formals->count;
@@ -783,11 +3542,22 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
   
-  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
+  lloc loc = v->loc;
+  v->hash = 0;
+  
+  /* Forms take their arguments unevaluated, so evaluate the head first */
+  int args = 0;
+  if (v->count) {
+    v->cell[0] = lval_eval(e, v->cell[0]);
+    args = v->cell[0]->type != LVAL_FUN || !v->cell[0]->form;
+  }
+  for (int i = 1; i < v->count && args; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
   for (int i = 0; i < v->count; i++) { if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); } }
   
   if (v->count == 0) { return v; }  
-  if (v->count == 1) { return lval_eval(e, lval_take(v, 0)); }
+  if (v->count == 1 && !(v->cell[0]->type == LVAL_FUN && v->cell[0]->nullary)) {
+    return lval_eval(e, lval_take(v, 0));
+  }
   
   lval* f = lval_pop(v, 0);
   if (f->type != LVAL_FUN) {
@@ -799,94 +3569,703 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     return err;
   }
   
+  /* Macros only run when code is expanded, never on evaluated arguments */
+  if (f->macro) {
+    lval* err = lval_err("Macro '%s' called at run time. "
+      "Macros must be defined before the code using them.", f->name);
+    lval_del(f); lval_del(v);
+    return err;
+  }
+  
+  if (lprof_enabled) { lprof_push(f); }
   lval* result = lval_call(e, f, v);
+  if (lprof_enabled) { lprof_pop(); }
+  if (result->type == LVAL_ERR && !f->builtin) { lval_trace(result, f->name, loc); }
   lval_del(f);
   return result;
 }
 
+lval* llimit_error(void) {
+  if (llimit_steps < 0) { return lval_err("Evaluation step limit of %li exceeded.", llimit_max_steps); }
+  if (llimit_bytes < 0) { return lval_err("Allocation limit of %li bytes exceeded.", llimit_max_bytes); }
+  return lval_err("Recursion depth limit of %li exceeded.", llimit_max_depth);
+}
+
 lval* lval_eval(lenv* e, lval* v) {
+  
+  /* Freeing v gives bytes back, so find which limit was hit first */
+  if (--llimit_steps < 0 || llimit_bytes < 0 || llimit_depth <= 0) {
+    lval* err = llimit_error();
+    lval_del(v);
+    return err;
+  }
+  
+  lval* x = v;
+  llimit_depth--;
   if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
+    x = lenv_get(e, v);
+    if (x->type == LVAL_ERR && !x->trace->loc.row) { x->trace->loc = v->loc; }
     lval_del(v);
-    return x;
   }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  return v;
+  else if (v->type == LVAL_SEXPR) {
+    lloc loc = v->loc;
+    x = lval_eval_sexpr(e, v);
+    if (x->type == LVAL_ERR && !x->trace->loc.row) { x->trace->loc = loc; }
+  }
+  llimit_depth++;
+  return x;
 }
 
 /* Reading */
 
-lval* lval_read_num(mpc_ast_t* t) {
+/*
+** The reader is built from mpc combinators whose callbacks make lvals
+** as they go, so there is no AST to build, walk and delete. It reads
+** the same language as lispy.grammar, skipping whitespace after every
+** token. Comments read as NULL.
+**
+** The combinators only read tokens, as nesting them would recurse once
+** per level of input, and data made by programs can be nested deeper
+** than the C stack allows. An opening bracket reads as an empty list
+** and a closing one as the symbol ")" or "}", which no symbol can be,
+** and lread_nest puts the tokens together into lists.
+*/
+
+mpc_parser_t* Token;
+mpc_parser_t* Lispy;
+
+/* File which the reader is reading from on this thread */
+LTHREAD int lread_file = 0;
+
+void lread_del(mpc_val_t* x) {
+  if (x) { lval_del(x); }
+}
+
+mpc_val_t* lread_num(mpc_val_t* x) {
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
-}
-
-lval* lval_read_str(mpc_ast_t* t) {
-  /* Cut off the final quote character */
-  t->contents[strlen(t->contents)-1] = '\0';
-  /* Copy the string missing out the first quote character */
-  char* unescaped = malloc(strlen(t->contents+1)+1);
-  strcpy(unescaped, t->contents+1);
-  /* Pass through the unescape function */
-  unescaped = mpcf_unescape(unescaped);
-  /* Construct a new lval using the string */
-  lval* str = lval_str(unescaped);
-  /* Free the string and return */
+  long n = strtol(x, NULL, 10);
+  free(x);
+  return errno != ERANGE ? lval_num(n) : lval_err("Invalid Number.");
+}
+
+mpc_val_t* lread_sym(mpc_val_t* x) {
+  lval* v = lval_sym(x);
+  free(x);
+  return v;
+}
+
+mpc_val_t* lread_str(mpc_val_t* x) {
+  /* Quotes are already gone so just unescape */
+  char* unescaped = mpcf_unescape(x);
+  lval* v = lval_str(unescaped);
   free(unescaped);
-  return str;
+  return v;
+}
+
+mpc_val_t* lread_bracket(mpc_val_t* x) {
+  char c = *(char*)x;
+  free(x);
+  switch (c) {
+    case '(': return lval_sexpr();
+    case '{': return lval_qexpr();
+    case ')': return lval_sym(")");
+    default:  return lval_sym("}");
+  }
+}
+
+/* Takes the state before a token and the token */
+mpc_val_t* lread_fold_loc(int n, mpc_val_t** xs) {
+  mpc_state_t* s = xs[0];
+  lval* v = xs[1];
+  lloc loc = { lread_file, s->col + 1, s->row + 1 };
+  v->loc = loc;
+  free(s);
+  return v;
+}
+
+mpc_parser_t* lread_at(mpc_parser_t* p) {
+  return mpc_and(2, lread_fold_loc, mpc_state(), p, free);
+}
+
+/* Every token of the input in order, and where the input ends */
+typedef struct {
+  int count;
+  lval** tokens;
+  lloc end;
+} lread_tokens;
+
+void lread_tokens_del(mpc_val_t* x) {
+  lread_tokens* t = x;
+  for (int i = 0; i < t->count; i++) { lread_del(t->tokens[i]); }
+  free(t->tokens);
+  free(t);
+}
+
+mpc_val_t* lread_fold_tokens(int n, mpc_val_t** xs) {
+  lread_tokens* t = malloc(sizeof(lread_tokens));
+  t->count = n;
+  t->tokens = malloc(sizeof(lval*) * (n > 0 ? n : 1));
+  memcpy(t->tokens, xs, sizeof(lval*) * n);
+  return t;
+}
+
+/* Takes the blank start, the tokens, the state at the end and the end */
+mpc_val_t* lread_fold_lispy(int n, mpc_val_t** xs) {
+  lread_tokens* t = xs[1];
+  mpc_state_t* s = xs[2];
+  lloc end = { lread_file, s->col + 1, s->row + 1 };
+  t->end = end;
+  free(s);
+  return t;
+}
+
+void lread_init(void) {
+  
+  mpc_parser_t* number = mpc_apply(mpc_or(2,
+    mpc_and(2, mpcf_strfold, mpc_char('-'), mpc_digits(), free),
+    mpc_digits()),
+    lread_num);
+  
+  mpc_parser_t* symbol = mpc_apply(mpc_many1(mpcf_strfold,
+    mpc_oneof("abcdefghijklmnopqrstuvwxyz"
+              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+              "0123456789_+-*/\\=<>!&?")),
+    lread_sym);
+  
+  /* Errors in an unfinished string are reported where it ends */
+  mpc_parser_t* string = mpc_apply(mpc_and(3, mpcf_snd_free,
+    mpc_expect(mpc_char('"'), "string"),
+    mpc_many(mpcf_strfold, mpc_or(2,
+      mpc_noneof("\"\\"),
+      mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free))),
+    mpc_char('"'), free, free),
+    lread_str);
+  
+  mpc_parser_t* comment = mpc_apply(mpc_and(2, mpcf_strfold,
+    mpc_char(';'), mpc_many(mpcf_strfold, mpc_noneof("\r\n")), free),
+    mpcf_free);
+  
+  mpc_parser_t* bracket = mpc_apply(mpc_oneof("(){}"), lread_bracket);
+  
+  /* Brackets are the most common tokens so are tried first */
+  Token = mpc_define(mpc_new("token"), mpc_or(5,
+    lread_at(mpc_tok(bracket)),
+    lread_at(mpc_expect(mpc_tok(number), "number")),
+    lread_at(mpc_expect(mpc_tok(symbol), "symbol")),
+    lread_at(mpc_tok(string)),
+    mpc_expect(mpc_tok(comment), "comment")));
+  
+  Lispy = mpc_define(mpc_new("lispy"), mpc_and(4, lread_fold_lispy,
+    mpc_blank(), mpc_many(lread_fold_tokens, Token), mpc_state(), mpc_eoi(),
+    mpcf_dtor_null, lread_tokens_del, free));
+}
+
+void lread_cleanup(void) {
+  mpc_cleanup(2, Token, Lispy);
+}
+
+/* The lists still open, outermost first */
+typedef struct {
+  int count;
+  int slots;
+  lval** open;
+} lread_nest;
+
+void lread_nest_init(lread_nest* n, lval* root) {
+  n->count = 1;
+  n->slots = 16;
+  n->open = malloc(sizeof(lval*) * n->slots);
+  n->open[0] = root;
 }
 
-lval* lval_read(mpc_ast_t* t) {
+/* Drop every list still open but the outermost */
+void lread_nest_reset(lread_nest* n) {
+  while (n->count > 1) { lval_del(n->open[--n->count]); }
+}
+
+void lread_nest_del(lread_nest* n) {
+  lread_nest_reset(n);
+  lval_del(n->open[0]);
+  free(n->open);
+}
+
+/* Put a token in the list opened last, or return 0 if it closes the wrong one */
+int lread_nest_add(lread_nest* n, lval* x) {
   
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  lval* top = n->open[n->count-1];
   
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } 
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  if (x->type == LVAL_SYM && (x->sym[0] == ')' || x->sym[0] == '}')) {
+    int type = x->sym[0] == ')' ? LVAL_SEXPR : LVAL_QEXPR;
+    if (n->count == 1 || top->type != type) { return 0; }
+    lval_del(x);
+    n->count--;
+    lval_add(n->open[n->count-1], top);
+    return 1;
+  }
   
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    if (n->count == n->slots) {
+      n->slots *= 2;
+      n->open = realloc(n->open, sizeof(lval*) * n->slots);
+    }
+    n->open[n->count++] = x;
+    return 1;
   }
   
-  return x;
+  lval_add(top, x);
+  return 1;
+}
+
+/* The error for finding something at loc other than the close expected */
+mpc_err_t* lread_nest_err(lread_nest* n, char* filename, lloc loc, char found) {
+  lval* top = n->open[n->count-1];
+  char* expected = n->count == 1 ? "end of input"
+    : top->type == LVAL_SEXPR ? "')'" : "'}'";
+  mpc_state_t s = { 0, loc.row - 1, loc.col - 1, 0 };
+  return mpc_err_expected(filename, s, expected, found);
+}
+
+/* Read all of source, or the file filename when source is NULL */
+int lval_read(char* filename, char* source, mpc_result_t* r) {
+  
+  lread_file = lname_index(filename);
+  int ok = source
+    ? mpc_parse(filename, source, Lispy, r)
+    : mpc_parse_contents(filename, Lispy, r);
+  if (!ok) { return 0; }
+  
+  lread_tokens* t = r->output;
+  lval* root = lval_sexpr();
+  lloc loc = { lread_file, 1, 1 };
+  root->loc = loc;
+  
+  lread_nest n;
+  lread_nest_init(&n, root);
+  mpc_err_t* err = NULL;
+  
+  for (int i = 0; i < t->count && !err; i++) {
+    lval* x = t->tokens[i];
+    t->tokens[i] = NULL;
+    if (x && !lread_nest_add(&n, x)) {
+      err = lread_nest_err(&n, filename, x->loc, x->sym[0]);
+      lval_del(x);
+    }
+  }
+  if (!err && n.count > 1) {
+    err = lread_nest_err(&n, filename, t->end, '\0');
+  }
+  lread_tokens_del(t);
+  
+  if (err) {
+    lread_nest_del(&n);
+    r->error = err;
+    return 0;
+  }
+  
+  free(n.open);
+  r->output = root;
+  return 1;
+}
+
+/* Streaming */
+
+/*
+** The stream is read a token at a time, so a long expression is never
+** parsed again from its start as more of it arrives, and the tokens are
+** put together with lread_nest as they come. Each expression is
+** evaluated once it is closed at the top level.
+*/
+
+void lval_eval_stream(lenv* e, FILE* f, char* filename) {
+  
+  mpc_stream_t* s = mpc_stream_new(filename, Token, lread_del);
+  mpc_stream_brackets(s, "", "", "\"", ";");
+  int file = lname_index(filename);
+  char chunk[4096];
+  int more = 1;
+  
+  lread_nest n;
+  lread_nest_init(&n, lval_sexpr());
+  lloc end = { file, 1, 1 };
+  
+  /* Each expression is read with the budget it is evaluated with */
+  llimit_reset();
+  
+  while (more) {
+    
+    /* Evaluation can load other files, so reset the file each time */
+    lread_file = file;
+    
+    /* Feed a line at a time, or signal the end of input */
+    if (fgets(chunk, sizeof(chunk), f)) {
+      mpc_stream_feed(s, chunk, strlen(chunk));
+      for (char* c = chunk; *c; c++) {
+        if (*c == '\n') { end.row++; end.col = 1; } else { end.col++; }
+      }
+    } else {
+      mpc_stream_finish(s);
+      more = 0;
+    }
+    
+    /* Evaluate every expression that has been completed */
+    mpc_result_t r;
+    int status;
+    while ((status = mpc_stream_next(s, &r)) != MPC_STREAM_NONE) {
+      
+      if (status == MPC_STREAM_ERROR) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        lread_nest_reset(&n);
+        continue;
+      }
+      
+      /* Comments read as NULL */
+      lval* x = r.output;
+      if (!x) { continue; }
+      
+      if (!lread_nest_add(&n, x)) {
+        mpc_err_t* err = lread_nest_err(&n, filename, x->loc, x->sym[0]);
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        lval_del(x);
+        lread_nest_reset(&n);
+        continue;
+      }
+      
+      if (n.count == 1 && n.open[0]->count) {
+        x = lval_eval(e, lval_expand(e, lval_pop(n.open[0], 0)));
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+        lread_file = file;
+        llimit_reset();
+      }
+    }
+  }
+  
+  /* Anything still open was cut off by the end of input */
+  if (n.count > 1) {
+    mpc_err_t* err = lread_nest_err(&n, filename, end, '\0');
+    mpc_err_print(err);
+    mpc_err_delete(err);
+  }
+  
+  lread_nest_del(&n);
+  mpc_stream_delete(s);
+}
+
+/* Threads */
+
+/*
+** With --parallel N the files which follow are evaluated by N threads
+** at once. The environment holding the builtins and anything loaded up
+** front is frozen and shared, and each file gets its own forked
+** environment, evaluation limits and output. Output is captured in a
+** temporary file and written out in the order the files were given,
+** as soon as every file before it has finished.
+*/
+
+typedef struct {
+  char* filename;
+  FILE* output;
+  lval* result;
+  int done;
+} lbatch_file;
+
+typedef struct {
+  lenv* shared;
+  lbatch_file* files;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+} lbatch;
+
+void lbatch_run(lbatch* b) {
+  while (1) {
+    int i = __sync_fetch_and_add(&b->next, 1);
+    if (i >= b->count) { break; }
+    lbatch_file* f = &b->files[i];
+    
+    lenv* e = lenv_fork(b->shared);
+    f->output = tmpfile();
+    lval_out = f->output;
+    llimit_reset();
+    lval* x = builtin_load(e, lval_add(lval_sexpr(), lval_str(f->filename)));
+    lval_out = NULL;
+    lenv_del(e);
+    
+    pthread_mutex_lock(&b->lock);
+    f->result = x;
+    f->done = 1;
+    pthread_cond_broadcast(&b->finished);
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+void* lbatch_worker(void* arg) {
+  lbatch_run(arg);
+  lprof_thread_end();
+  lval_free_all();
+  return NULL;
+}
+
+void lval_eval_parallel(lenv* e, int threads, int count, char** filenames) {
+  
+  lbatch b;
+  b.shared = e;
+  b.files = calloc(count, sizeof(lbatch_file));
+  b.count = count;
+  b.next = 0;
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.finished, NULL);
+  for (int i = 0; i < count; i++) { b.files[i].filename = filenames[i]; }
+  
+  lenv_freeze(e);
+  
+  /* Evaluation recurses deeply so give each thread a large stack */
+  if (threads > count) { threads = count; }
+  pthread_t* workers = malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, LTHREAD_STACK);
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[started], &attr, lbatch_worker, &b) == 0) { started++; }
+  }
+  pthread_attr_destroy(&attr);
+  
+  /* Without any threads evaluate everything here instead */
+  if (started == 0) { lbatch_run(&b); }
+  
+  /* Write out each file's output and any error, in order */
+  for (int i = 0; i < count; i++) {
+    lbatch_file* f = &b.files[i];
+    pthread_mutex_lock(&b.lock);
+    while (!f->done) { pthread_cond_wait(&b.finished, &b.lock); }
+    pthread_mutex_unlock(&b.lock);
+    
+    if (f->output) {
+      char chunk[4096];
+      size_t n;
+      rewind(f->output);
+      while ((n = fread(chunk, 1, sizeof(chunk), f->output)) > 0) {
+        fwrite(chunk, 1, n, stdout);
+      }
+      fclose(f->output);
+    }
+    
+    if (f->result->type == LVAL_ERR) { lval_println(f->result); }
+    lval_del(f->result);
+  }
+  
+  for (int i = 0; i < started; i++) { pthread_join(workers[i], NULL); }
+  
+  pthread_mutex_destroy(&b.lock);
+  pthread_cond_destroy(&b.finished);
+  free(workers);
+  free(b.files);
+}
+
+/* Serving */
+
+/*
+** With --serve the interpreter listens on a Unix socket. Each request
+** is a 4 byte little endian length followed by that much Lispy source.
+** The reply has the same form and holds everything the request printed,
+** followed by the value of each expression as the prompt would show it.
+** Every request is evaluated in a new environment forked from the
+** frozen one built before --serve, so requests cannot see each other's
+** definitions. Each connection is served on its own thread.
+*/
+
+#ifndef _WIN32
+
+#define LSERVE_MAX_REQUEST (16 * 1024 * 1024)
+
+int lserve_read(int fd, void* data, size_t n) {
+  char* p = data;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r <= 0) { return 0; }
+    p += r; n -= r;
+  }
+  return 1;
+}
+
+int lserve_write(int fd, void* data, size_t n) {
+  char* p = data;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r <= 0) { return 0; }
+    p += r; n -= r;
+  }
+  return 1;
+}
+
+int lserve_read_u32(int fd, unsigned* x) {
+  unsigned char b[4];
+  if (!lserve_read(fd, b, 4)) { return 0; }
+  *x = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned)b[3] << 24);
+  return 1;
+}
+
+int lserve_write_u32(int fd, unsigned x) {
+  unsigned char b[4] = { x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, (x >> 24) & 0xFF };
+  return lserve_write(fd, b, 4);
+}
+
+char* lserve_eval(lenv* shared, char* source, size_t* length) {
+  
+  char* output = NULL;
+  FILE* f = open_memstream(&output, length);
+  lval_out = f;
+  
+  /* The whole request, read and evaluated, shares one budget like a file */
+  lenv* e = lenv_fork(shared);
+  llimit_reset();
+  mpc_result_t r;
+  if (lval_read("<request>", source, &r)) {
+    lval* expr = r.output;
+    while (expr->count) {
+      lval* x = lval_eval(e, lval_expand(e, lval_pop(expr, 0)));
+      lval_println(x);
+      lval_del(x);
+    }
+    lval_del(expr);
+  } else {
+    char* err = mpc_err_string(r.error);
+    fputs(err, f);
+    free(err);
+    mpc_err_delete(r.error);
+  }
+  lenv_del(e);
+  
+  lval_out = NULL;
+  fclose(f);
+  return output;
+}
+
+typedef struct {
+  lenv* shared;
+  int fd;
+} lconn;
+
+void* lserve_conn(void* arg) {
+  lconn* c = arg;
+  
+  unsigned n;
+  while (lserve_read_u32(c->fd, &n) && n <= LSERVE_MAX_REQUEST) {
+    
+    char* source = malloc(n + 1);
+    if (!lserve_read(c->fd, source, n)) { free(source); break; }
+    source[n] = '\0';
+    
+    size_t length;
+    char* output = lserve_eval(c->shared, source, &length);
+    free(source);
+    
+    int ok = lserve_write_u32(c->fd, length) && lserve_write(c->fd, output, length);
+    free(output);
+    if (!ok) { break; }
+  }
+  
+  close(c->fd);
+  free(c);
+  lprof_thread_end();
+  lval_free_all();
+  return NULL;
+}
+
+void lval_serve(lenv* e, char* path) {
+  
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, 64) < 0) {
+    perror(path);
+    if (s >= 0) { close(s); }
+    return;
+  }
+  
+  /* Clients that hang up early must not stop the server */
+  signal(SIGPIPE, SIG_IGN);
+  lenv_freeze(e);
+  
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, LTHREAD_STACK);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  
+  while (1) {
+    int fd = accept(s, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      perror(path);
+      break;
+    }
+    lconn* c = malloc(sizeof(lconn));
+    c->shared = e;
+    c->fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, lserve_conn, c) != 0) {
+      close(fd);
+      free(c);
+    }
+  }
+  
+  pthread_attr_destroy(&attr);
+  close(s);
 }
 
+#else
+
+void lval_serve(lenv* e, char* path) {
+  fputs("Serving is not supported on this platform\n", stderr);
+}
+
+#endif
+
 /* Main */
 
+void lval_usage(void) {
+  puts("Usage: strings [option | file]...\n"
+    "\n"
+    "Evaluates each file in turn, or starts a prompt if given nothing.\n"
+    "Options apply to the files after them.\n"
+    "\n"
+    "  -                    evaluate stdin an expression at a time as it arrives\n"
+    "  --image FILE         load the bindings saved in an image\n"
+    "  --save-image FILE    save the global bindings to an image\n"
+    "  --max-steps N        stop after N evaluation steps\n"
+    "  --max-bytes N        stop once the values live at once take over N bytes;\n"
+    "                       freed values give their bytes back, so this limits\n"
+    "                       the memory held, not the total ever allocated\n"
+    "  --max-depth N        stop when calls nest over N deep, 10000 by default\n"
+    "                       once either other limit is set\n"
+    "  --workers N          run pmap, pfilter and preduce on N threads\n"
+    "  --parallel N FILE... evaluate the remaining files N at a time\n"
+    "  --serve PATH         serve requests on a unix socket at PATH\n"
+    "  --profile            write a profile to lispy.prof on exit\n"
+    "  --stats              print allocation and builtin statistics on exit\n"
+    "  --help               print this message\n"
+    "\n"
+    "Limits apply to each file, line, request or streamed expression,\n"
+    "including reading it.");
+}
+
 int main(int argc, char** argv) {
   
-  Number  = mpc_new("number");
-  Symbol  = mpc_new("symbol");
-  String  = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr   = mpc_new("sexpr");
-  Qexpr   = mpc_new("qexpr");
-  Expr    = mpc_new("expr");
-  Lispy   = mpc_new("lispy");
-  
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                              \
-      number  : /-?[0-9]+/ ;                       \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-      string  : /\"(\\\\.|[^\"])*\"/ ;             \
-      comment : /;[^\\r\\n]*/ ;                    \
-      sexpr   : '(' <expr>* ')' ;                  \
-      qexpr   : '{' <expr>* '}' ;                  \
-      expr    : <number>  | <symbol> | <string>    \
-              | <comment> | <sexpr>  | <qexpr>;    \
-      lispy   : /^/ <expr>* /$/ ;                  \
-    ",
-    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  lread_init();
   
   lenv* e = lenv_new();
   lenv_add_builtins(e);
@@ -902,14 +4281,15 @@ int main(int argc, char** argv) {
       char* input = readline("lispy> ");
       add_history(input);
       
+      /* Reading the line takes from the budget too */
+      llimit_reset();
       mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
+      if (lval_read("<stdin>", input, &r)) {
         
-        lval* x = lval_eval(e, lval_read(r.output));
+        lval* x = lval_eval(e, lval_expand(e, r.output));
         lval_println(x);
         lval_del(x);
         
-        mpc_ast_delete(r.output);
       } else {    
         mpc_err_print(r.error);
         mpc_err_delete(r.error);
@@ -926,11 +4306,77 @@ int main(int argc, char** argv) {
     /* loop over each supplied filename (starting from 1) */
     for (int i = 1; i < argc; i++) {
       
+      if (strcmp(argv[i], "--help") == 0) {
+        lval_usage();
+        break;
+      }
+      
+      /* A filename of - evaluates stdin as it arrives */
+      if (strcmp(argv[i], "-") == 0) {
+        lval_eval_stream(e, stdin, "<stdin>");
+        continue;
+      }
+      
+      /* Profile everything evaluated from here on */
+      if (strcmp(argv[i], "--profile") == 0) {
+        lprof_start();
+        continue;
+      }
+      
+      /* Collect statistics from here on and print them on exit */
+      if (strcmp(argv[i], "--stats") == 0) {
+        lstat_enabled = 1;
+        continue;
+      }
+      
+      /* Limits apply to each file, line, request or streamed expression */
+      if (strcmp(argv[i], "--max-steps") == 0 && i+1 < argc) {
+        llimit_max_steps = atol(argv[++i]);
+        if (!llimit_max_depth) { llimit_max_depth = LLIMIT_DEPTH_DEFAULT; }
+        continue;
+      }
+      if (strcmp(argv[i], "--max-bytes") == 0 && i+1 < argc) {
+        llimit_max_bytes = atol(argv[++i]);
+        if (!llimit_max_depth) { llimit_max_depth = LLIMIT_DEPTH_DEFAULT; }
+        continue;
+      }
+      if (strcmp(argv[i], "--max-depth") == 0 && i+1 < argc) {
+        llimit_max_depth = atol(argv[++i]);
+        continue;
+      }
+      
+      /* Size of the pool used by pmap, pfilter and preduce */
+      if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+        lpool_size = atoi(argv[++i]);
+        continue;
+      }
+      
+      /* Serve requests against everything loaded so far */
+      if (strcmp(argv[i], "--serve") == 0 && i+1 < argc) {
+        lval_serve(e, argv[++i]);
+        break;
+      }
+      
+      /* Files after --parallel N are evaluated N at a time */
+      if (strcmp(argv[i], "--parallel") == 0 && i+1 < argc) {
+        lval_eval_parallel(e, atoi(argv[i+1]), argc-i-2, argv+i+2);
+        break;
+      }
+      
+      /* Images are loaded or saved with their option in front */
+      lbuiltin func = builtin_load;
+      if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+        func = builtin_load_image; i++;
+      } else if (strcmp(argv[i], "--save-image") == 0 && i+1 < argc) {
+        func = builtin_save_image; i++;
+      }
+      
       /* Argument list with a single argument, the filename */
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
       
-      /* Pass to builtin load and get the result */
-      lval* x = builtin_load(e, args);
+      /* Pass to builtin and get the result */
+      llimit_reset();
+      lval* x = func(e, args);
       
       /* If the result is an error be sure to print it */
       if (x->type == LVAL_ERR) { lval_println(x); }
@@ -938,11 +4384,13 @@ int main(int argc, char** argv) {
     }
   }
   
+  lpool_finish();
+  lprof_write("lispy.prof");
+  lstat_write(stderr);
+  
   lenv_del(e);
   
-  mpc_cleanup(8, 
-    Number, Symbol, String, Comment, 
-    Sexpr,  Qexpr,  Expr,   Lispy);
+  lread_cleanup();
   
   return 0;
 }
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# The benchmark harness prints a JSON line for every interpreter and
+# workload, takes the baseline off each, and fails if a run fails.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf '(load "prelude.lspy")\n' > "$dir/base.lspy"
+printf '(load "prelude.lspy")\n(fib 15)\n' > "$dir/fib.lspy"
+
+out=$(bench/bench -r 2 -b "$dir/base.lspy" ./strings ./hand_rolled_parser -- "$dir/fib.lspy") \
+  || { printf '%s\n' "$out"; exit 1; }
+
+line='{"interpreter": "[a-z_]*", "workload": "fib.lspy", "reps": 2, "ns_per_op": [1-9][0-9]*, "allocs_per_op": -1, "peak_rss_kb": [1-9][0-9]*, "baseline_ns": [1-9][0-9]*, "baseline_allocs": -1, "status": 0}'
+[ "$(printf '%s\n' "$out" | grep -c "^$line\$")" = 2 ] || { printf '%s\n' "$out"; exit 1; }
+
+# Without a baseline nothing is taken off
+out=$(bench/bench -r 1 ./strings -- "$dir/fib.lspy")
+printf '%s\n' "$out" | grep -q '"baseline_ns": 0, "baseline_allocs": 0, "status": 0}$' \
+  || { printf '%s\n' "$out"; exit 1; }
+
+# A workload which cannot run is reported and fails the whole run
+if out=$(bench/bench -r 1 ./missing -- "$dir/fib.lspy"); then
+  printf '%s\n' "$out"; exit 1
+fi
+printf '%s\n' "$out" | grep -q '"status": 127}$' || { printf '%s\n' "$out"; exit 1; }
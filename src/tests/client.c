@@ -0,0 +1,73 @@
+/*
+** Test client for the Lispy --serve mode.
+**
+** Usage: client socket request...
+**
+** Sends each request on a connection of its own, so nothing is shared
+** between them except the server, and prints each reply on stdout.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int client_io(int fd, void* data, size_t n, int writing) {
+  char* p = data;
+  while (n > 0) {
+    ssize_t r = writing ? write(fd, p, n) : read(fd, p, n);
+    if (r <= 0) { return 0; }
+    p += r; n -= r;
+  }
+  return 1;
+}
+
+static int client_request(const char* path, const char* source) {
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror(path);
+    if (fd >= 0) { close(fd); }
+    return 0;
+  }
+
+  /* Lengths are 4 bytes little endian on both sides */
+  unsigned n = strlen(source);
+  unsigned char b[4] = { n & 0xFF, (n >> 8) & 0xFF, (n >> 16) & 0xFF, (n >> 24) & 0xFF };
+  int ok = client_io(fd, b, 4, 1) && client_io(fd, (void*)source, n, 1)
+        && client_io(fd, b, 4, 0);
+
+  if (ok) {
+    n = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned)b[3] << 24);
+    char* reply = malloc(n);
+    ok = client_io(fd, reply, n, 0);
+    if (ok) { fwrite(reply, 1, n, stdout); }
+    free(reply);
+  }
+
+  close(fd);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s socket request...\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 2; i < argc; i++) {
+    if (!client_request(argv[1], argv[i])) { return 1; }
+  }
+
+  return 0;
+}
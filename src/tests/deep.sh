@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Data nested far deeper than the C stack allows must still be read,
+# defined, copied, compared, printed and deleted.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+  for (i = 0; i < 200000; i++) { printf "{" }
+  printf "1"
+  for (i = 0; i < 200000; i++) { printf "}" }
+}' > "$dir/literal"
+
+{ printf '(def {d} '; cat "$dir/literal"; printf ')\n(def {e} d)\n(print d)\n(print (== d e))\n'; } > "$dir/deep.lspy"
+{ cat "$dir/literal"; printf ' \n1 \n'; } > "$dir/expected"
+
+for run in "./strings $dir/deep.lspy" "./strings /dev/stdin" "./hand_rolled_parser $dir/deep.lspy"; do
+  $run < "$dir/deep.lspy" > "$dir/out" 2>&1
+  cmp -s "$dir/out" "$dir/expected" || { echo "$run"; head -c 200 "$dir/out"; exit 1; }
+done
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Errors give the place they came from and the calls they came out of,
+# however far along a line or deep in calls they happen.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/calls.lspy" <<'LSPY'
+(def {inner} (\ {x} {+ x y}))
+(def {outer} (\ {x} {inner x}))
+(outer 1)
+(print (catch {outer 1}))
+(print (catch {+ 1 1}))
+(def {deep} (\ {n} {if (== n 0) {error "bottom"} {deep (- n 1)}}))
+(deep 20)
+LSPY
+
+expected="Error: Unbound Symbol 'y' at $dir/calls.lspy:1:26
+  in inner at $dir/calls.lspy:2:21
+  in outer at $dir/calls.lspy:3:1
+{\"Unbound Symbol \\'y\\'\" \"$dir/calls.lspy\" 1 26 {{\"inner\" \"$dir/calls.lspy\" 2 21} {\"outer\" \"$dir/calls.lspy\" 4 15}}} 
+{} 
+Error: bottom at $dir/calls.lspy:6:33"
+
+out=$(./strings "$dir/calls.lspy" 2>&1 | head -6)
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+
+# Frames past the first 16 are counted rather than kept
+out=$(./strings "$dir/calls.lspy" 2>&1 | tail -2)
+case "$out" in
+  *"in deep at $dir/calls.lspy:6:50
+  and 5 more calls") ;;
+  *) printf '%s\n' "$out"; exit 1 ;;
+esac
+
+# Columns are not limited to 16 bits
+awk 'BEGIN { printf "%70000s(+ 1 z)\n", "" }' > "$dir/wide.lspy"
+out=$(./strings "$dir/wide.lspy" 2>&1)
+[ "$out" = "Error: Unbound Symbol 'z' at $dir/wide.lspy:1:70006" ] || { printf '%s\n' "$out"; exit 1; }
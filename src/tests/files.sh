@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Files opened with 'open' are read a line or a chunk at a time, and
+# 'lines' streams through a file without ever holding more than a line.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/io.lspy" <<LSPY
+(def {f} (open "$dir/out.txt" "w"))
+(write f "one\\ntwo\\r\\n\\nfour")
+(close f)
+(def {f} (open "$dir/out.txt" "a"))
+(write f "\\nfive\\n")
+(close f)
+(write f "late")
+(def {f} (open "$dir/out.txt"))
+(print (read-line f) (read-line f) (read-line f))
+(print (read-chunk f 3) (read-chunk f 100) (read-chunk f 1) (read-line f))
+(close f)
+(read-line f)
+(close f)
+(print (realize (lines "$dir/out.txt")))
+(def {g} (open "$dir/out.txt"))
+(read-line g)
+(print (realize (lines g)))
+(open "$dir/missing.txt")
+(open "$dir/out.txt" "rw")
+(read-chunk g 0)
+LSPY
+
+expected="\"one\" \"two\" \"\" 
+\"fou\" \"r\nfive\n\" {} {} 
+{\"one\" \"two\" \"\" \"four\" \"five\"} 
+{\"two\" \"\" \"four\" \"five\"} "
+
+out=$(./strings "$dir/io.lspy" 2>&1 | grep -v '^Error')
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+
+errors="Error: Function 'write' passed a closed file. at $dir/io.lspy:7:1
+Error: Function 'read-line' passed a closed file. at $dir/io.lspy:12:1
+Error: Function 'close' passed a closed file. at $dir/io.lspy:13:1
+Error: Could not open file $dir/missing.txt at $dir/io.lspy:18:1
+Error: Function 'open' passed invalid mode 'rw'. at $dir/io.lspy:19:1
+Error: Function 'read-chunk' passed a size of 0. at $dir/io.lspy:20:1"
+
+out=$(./strings "$dir/io.lspy" 2>&1 | grep '^Error')
+[ "$out" = "$errors" ] || { printf '%s\n' "$out"; exit 1; }
+
+# A file far bigger than the allocation limit can still be folded over
+awk 'BEGIN { for (i = 1; i <= 200000; i++) print "line", i }' > "$dir/big.txt"
+cat > "$dir/big.lspy" <<LSPY
+(print (lazy-fold (\\ {n l} {+ n 1}) 0 (lines "$dir/big.txt")))
+(print (realize (lines "$dir/big.txt")))
+LSPY
+
+out=$(./strings --max-bytes 1000000 "$dir/big.lspy" 2>&1)
+case "$out" in
+  "200000 
+Error: "*) ;;
+  *) printf '%s\n' "$out" | head -c 1000; exit 1 ;;
+esac
@@ -0,0 +1,71 @@
+/*
+** Test for parsers written by mpc_gen.
+**
+** Usage: grammar file...
+**
+** Parses each file with the parsers mpc_gen wrote to lispy_grammar.c,
+** and with lispy.grammar built by mpca_lang at run time, and checks
+** both give the same tree or the same error. Exits with status 1,
+** after printing what was wrong, if any file parses differently.
+*/
+
+#include "../mpc.h"
+
+extern mpc_parser_t* lispy_lispy;
+
+static int failed = 0;
+
+static void check(const char* filename, mpc_parser_t* built) {
+  
+  mpc_result_t a, b;
+  int a_ok = mpc_parse_contents(filename, lispy_lispy, &a);
+  int b_ok = mpc_parse_contents(filename, built, &b);
+  
+  if (a_ok && b_ok) {
+    if (!mpc_ast_eq(a.output, b.output)) {
+      fprintf(stderr, "failed: %s parses to a different tree\n", filename);
+      failed = 1;
+    }
+  } else if (!a_ok && !b_ok) {
+    char* x = mpc_err_string(a.error);
+    char* y = mpc_err_string(b.error);
+    if (strcmp(x, y) != 0) {
+      fprintf(stderr, "failed: %s gives a different error\n%s%s", filename, x, y);
+      failed = 1;
+    }
+    free(x);
+    free(y);
+  } else {
+    fprintf(stderr, "failed: %s parses with only one parser\n", filename);
+    failed = 1;
+  }
+  
+  if (a_ok) { mpc_ast_delete(a.output); } else { mpc_err_delete(a.error); }
+  if (b_ok) { mpc_ast_delete(b.output); } else { mpc_err_delete(b.error); }
+}
+
+int main(int argc, char** argv) {
+  
+  mpc_parser_t* Number  = mpc_new("number");
+  mpc_parser_t* Symbol  = mpc_new("symbol");
+  mpc_parser_t* String  = mpc_new("string");
+  mpc_parser_t* Comment = mpc_new("comment");
+  mpc_parser_t* Sexpr   = mpc_new("sexpr");
+  mpc_parser_t* Qexpr   = mpc_new("qexpr");
+  mpc_parser_t* Expr    = mpc_new("expr");
+  mpc_parser_t* Lispy   = mpc_new("lispy");
+  
+  mpc_err_t* err = mpca_lang_contents(MPCA_LANG_DEFAULT, "lispy.grammar",
+    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy, NULL);
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 1;
+  }
+  
+  for (int i = 1; i < argc; i++) { check(argv[i], Lispy); }
+  
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  
+  return failed;
+}
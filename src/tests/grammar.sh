@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# The parser mpc_gen writes from lispy.grammar reads every test, and a
+# file with a syntax error, just as the grammar built at run time does.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf '(+ 1 {2 "three\\"" ; four\n 5}\n(x y' > "$dir/unclosed.lspy"
+
+./tests/grammar prelude.lspy tests/*.lspy tests/hand_rolled/*.lspy "$dir/unclosed.lspy"
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# An image saved with --save-image must load with --image into the same
+# bindings, values, closures and macros, and a broken or unsaveable
+# image must give an error instead.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/save.lspy" <<'LSPY'
+(def {n} -9223372036854775807)
+(def {s} "tab\there \"quoted\"")
+(def {q} {1 {a {"b" {}}} (+ 1 2)})
+(def {add} (\ {x y} {+ x y}))
+(def {add5} (add 5))
+(def {plus} +)
+(defmacro {twice x} {join {list} (list x x)})
+LSPY
+
+cat > "$dir/load.lspy" <<'LSPY'
+(print n s q)
+(print (add5 10) (plus 1 2) (twice 3))
+(print (fst (map add5 {1 2})))
+(print (eval (head (tail q))))
+LSPY
+
+expected='-9223372036854775807 "tab\there \"quoted\"" {1 {a {"b" {}}} (+ 1 2)} 
+15 3 {3 3} 
+6 
+{a {"b" {}}} '
+
+./strings prelude.lspy "$dir/save.lspy" --save-image "$dir/all.img" || exit 1
+out=$(./strings --image "$dir/all.img" "$dir/load.lspy" 2>&1)
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+
+# Loading an image replaces bindings made before it
+printf '(def {n} 1)\n' > "$dir/before.lspy"
+out=$(./strings "$dir/before.lspy" --image "$dir/all.img" "$dir/load.lspy" 2>&1)
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+
+# A truncated image or another file is rejected as a whole
+head -c 200 "$dir/all.img" > "$dir/cut.img"
+printf '(print 1)' > "$dir/text.img"
+for img in cut text; do
+  out=$(./strings --image "$dir/$img.img" 2>&1)
+  [ "$out" = "Error: Invalid Image $dir/$img.img" ] || { printf '%s\n' "$out"; exit 1; }
+done
+
+# Open files belong to the process and cannot be saved
+printf '(def {f} (open "%s" "r"))\n(save-image "%s")\n' "$dir/load.lspy" "$dir/file.img" > "$dir/file.lspy"
+out=$(./strings "$dir/file.lspy" 2>&1)
+[ "$out" = "Error: Could not save Image $dir/file.img at $dir/file.lspy:2:1" ] || { printf '%s\n' "$out"; exit 1; }
+[ ! -e "$dir/file.img" ] || { echo "partial image left behind"; exit 1; }
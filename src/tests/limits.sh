@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# The byte limit counts bytes live at once rather than every allocation,
+# and setting any limit keeps recursion from overflowing the stack.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/fib.lspy" <<'LSPY'
+(fun {fib-slow n} {if (< n 2) {n} {+ (fib-slow (- n 1)) (fib-slow (- n 2))}})
+(print (fib-slow 20))
+LSPY
+out=$(./strings --max-bytes 10000000 prelude.lspy "$dir/fib.lspy" 2>&1)
+[ "$out" = "6765 " ] || { echo "$out"; exit 1; }
+
+cat > "$dir/deep.lspy" <<'LSPY'
+(fun {deep n} {if (== n 0) {0} {+ 1 (deep (- n 1))}})
+(deep 1000000)
+LSPY
+out=$(./strings --max-steps 1000000000 prelude.lspy "$dir/deep.lspy" 2>&1)
+case "$out" in
+  "Error: Recursion depth limit of 10000 exceeded."*) ;;
+  *) echo "$out" | head -1; exit 1 ;;
+esac
+
+# Reading takes from the same budget, so input bigger than the limit is
+# refused, and the next expression starts with a fresh budget
+awk 'BEGIN { printf "(print (head {"; for (i = 0; i < 2000; i++) printf " %d", i; print "}))"; print "(print 1)" }' > "$dir/big.lspy"
+expected='Error: Allocation limit of 100000 bytes exceeded.
+1 '
+out=$(./strings --max-bytes 100000 - < "$dir/big.lspy" 2>&1)
+[ "$out" = "$expected" ] || { echo "$out"; exit 1; }
+out=$(./strings --max-bytes 1000000 - < "$dir/big.lspy" 2>&1)
+[ "$out" = "{0} 
+1 " ] || { echo "$out"; exit 1; }
+
+./strings --help | grep -q "not the total ever allocated" || { ./strings --help; exit 1; }
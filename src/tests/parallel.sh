@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# --parallel N writes each file's output, then its error if it has one,
+# in the order the files were given, however many threads run them and
+# whichever finishes first.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# The first file is by far the slowest
+printf '(print (fib 18))\n(def {fib} 0)\n(print fib)\n' > "$dir/slow.lspy"
+printf '(print (fib 5))\n(def {x} 1)\n(print x)\n(error "bad")\n(print "after")\n' > "$dir/error.lspy"
+printf '(print x)\n(print (fib 3))\n' > "$dir/fresh.lspy"
+
+expected="2584 
+0 
+5 
+1 
+Error: bad at $dir/error.lspy:4:1
+\"after\" 
+Error: Could not load Library $dir/missing.lspy: error: Unable to open file!
+
+Error: Unbound Symbol 'x' at $dir/fresh.lspy:1:8
+2 "
+
+for n in 0 1 2 4 16; do
+  out=$(./strings prelude.lspy --parallel $n "$dir/slow.lspy" "$dir/error.lspy" \
+    "$dir/missing.lspy" "$dir/fresh.lspy" 2>&1)
+  [ "$out" = "$expected" ] || { echo "--parallel $n"; printf '%s\n' "$out"; exit 1; }
+done
+
+# With no files nothing is run
+out=$(./strings prelude.lspy --parallel 4 2>&1 </dev/null)
+[ -z "$out" ] || { printf '%s\n' "$out"; exit 1; }
@@ -0,0 +1,10 @@
+#!/bin/sh
+#
+# pmap.lspy must give the same output on one worker, where nothing is
+# split, and on several, where long lists are split into chunks.
+#
+
+for workers in 1 4; do
+  out=$(./strings --workers $workers tests/pmap.lspy 2>&1)
+  [ "$out" = "$(cat tests/pmap.out)" ] || { printf '%s\n' "$out"; exit 1; }
+done
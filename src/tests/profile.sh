@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# --profile writes a flat profile to lispy.prof and folded stacks to
+# lispy.prof.folded in the working directory, both counting the same
+# samples, and nothing at all without it.
+#
+
+src=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+printf '(fib 22)\n' > fib.lspy
+"$src/strings" "$src/prelude.lspy" fib.lspy > /dev/null
+[ ! -e lispy.prof ] || { echo "profile written without --profile"; exit 1; }
+
+"$src/strings" --profile "$src/prelude.lspy" fib.lspy > /dev/null
+[ -e lispy.prof ] && [ -e lispy.prof.folded ] || { echo "no profile written"; exit 1; }
+
+samples=$(sed -n 's/^# samples \([0-9]*\) dropped 0 interval 1000us$/\1/p' lispy.prof)
+[ -n "$samples" ] && [ "$samples" -gt 0 ] || { cat lispy.prof; exit 1; }
+
+# Every sample is under the top level, and most are under fib
+awk -v n="$samples" '
+  $3 == "<toplevel>" { top = $2 }
+  $3 == "fib" { fib = $2 }
+  END { exit !(top == n && fib * 2 > n) }' lispy.prof || { cat lispy.prof; exit 1; }
+
+awk -v n="$samples" '
+  $1 !~ /^<toplevel>(;|$)/ { bad = 1 }
+  { total += $NF }
+  END { exit bad || total != n }' lispy.prof.folded || { cat lispy.prof.folded; exit 1; }
@@ -0,0 +1,8 @@
+#!/bin/sh
+#
+# A file which cannot be read in one go, such as a pipe, is read as it
+# arrives instead, and must read the same.
+#
+
+out=$(cat tests/read.lspy | ./strings /dev/stdin 2>&1)
+[ "$out" = "$(cat tests/read.out)" ] || { printf '%s\n' "$out"; exit 1; }
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# The reader builds values straight from the source, so the tokens it
+# reads, the places it gives them and its syntax errors are checked
+# here rather than through a tree.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/ok.lspy" <<'LSPY'
+(print -5 (- 5) {- -} {a?b +1 -0 007})
+(print {;x
+  1;y
+  {}})
+(print "" "a;b" "{(")
+(print {1 {2 {3 {4 {5}}}}} {(()) {{}}})
+(print (head {x y}) ( + 1 (
+ * 2 3 ) ))
+  (+ 1
+     {2})
+LSPY
+
+expected="-5 -5 {- -} {a?b +1 0 7} 
+{1 {}} 
+\"\" \"a;b\" \"{(\" 
+{1 {2 {3 {4 {5}}}}} {(()) {{}}} 
+{x} 7 
+Error: Function '+' passed incorrect type for argument 1. Got Q-Expression, Expected Number. at $dir/ok.lspy:9:3"
+
+out=$(./strings "$dir/ok.lspy" 2>&1)
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+
+# Each syntax error is reported where it was found
+check() {
+  printf '%s' "$1" > "$dir/bad.lspy"
+  out=$(./strings "$dir/bad.lspy" 2>&1)
+  [ "$out" = "Error: Could not load Library $dir/bad.lspy:$2" ] || { printf '%s\n' "$out"; exit 1; }
+}
+
+check '(+ 1 2' "1:7: error: expected ')' at end of input"
+check '(+ 1 2}' "1:7: error: expected ')' at '}'"
+check '{1 (2
+3})' "2:2: error: expected ')' at '}'"
+check ')' "1:1: error: expected end of input at ')'"
+check '(print 1)) (print 2)' "1:10: error: expected end of input at ')'"
+check '(print "abc' "1:12: error: expected none of '\"\\', '\\' or '\"' at end of input"
+check '(print @)' "1:8: error: expected one of '(){}', number, symbol, string, comment or end of input at '@'"
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs every test from the src directory and reports each result.
+#
+# A test is either name.lspy, whose output from ./strings must match
+# name.out exactly, or name.sh, which must exit with status 0. Tests in
+# tests/hand_rolled are run by ./hand_rolled_parser instead.
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+failed=0
+
+run() {
+  if "$1" "$2" 2>&1 | diff -u "${2%.lspy}.out" - > tests/diff.txt; then
+    echo "PASS $2"
+  else
+    echo "FAIL $2"; cat tests/diff.txt; failed=1
+  fi
+}
+
+for t in tests/*.lspy; do
+  [ -e "$t" ] && run ./strings "$t"
+done
+for t in tests/hand_rolled/*.lspy; do
+  [ -e "$t" ] && run ./hand_rolled_parser "$t"
+done
+rm -f tests/diff.txt
+
+for t in tests/*.sh; do
+  [ "$t" = tests/run.sh ] && continue
+  if sh "$t"; then echo "PASS $t"; else echo "FAIL $t"; failed=1; fi
+done
+
+exit $failed
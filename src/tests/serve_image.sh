@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Under --serve, load-image and save-image must only touch the
+# environment of the request, never the frozen one it is forked from.
+#
+
+dir=$(mktemp -d)
+pid=
+trap '[ -n "$pid" ] && kill $pid; rm -rf "$dir"' EXIT
+
+printf '(def {leak} 42)\n' > "$dir/leak.lspy"
+./strings "$dir/leak.lspy" --save-image "$dir/leak.img" || exit 1
+
+./strings prelude.lspy --serve "$dir/sock" &
+pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$dir/sock" ] && break
+  sleep 0.2
+done
+
+# A binding loaded from an image does not reach the next connection
+out=$(tests/client "$dir/sock" \
+  "(load-image \"$dir/leak.img\") leak" \
+  "leak")
+expected='()
+42
+Error: Unbound Symbol '"'leak'"' at <request>:1:1'
+[ "$out" = "$expected" ] || { echo "$out"; exit 1; }
+
+# A saved image holds the request's definitions but not the prelude
+tests/client "$dir/sock" "(def {mine} 7) (save-image \"$dir/mine.img\")" > /dev/null
+printf '(print mine)\n(fib 5)\n' > "$dir/check.lspy"
+out=$(./strings --image "$dir/mine.img" "$dir/check.lspy")
+expected='7 
+Error: Unbound Symbol '"'fib'"' at '"$dir"'/check.lspy:2:2'
+[ "$out" = "$expected" ] || { echo "$out"; exit 1; }
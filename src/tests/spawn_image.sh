@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# Definitions shared with spawned tasks are still saved in images.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/save.lspy" <<LSPY
+(def {x} 1)
+(def {y} (await (spawn {+ x 1})))
+(def {x} 3)
+(save-image "$dir/spawn.img")
+LSPY
+printf '(print x y)\n' > "$dir/load.lspy"
+
+./strings "$dir/save.lspy" || exit 1
+out=$(./strings --image "$dir/spawn.img" "$dir/load.lspy" 2>&1)
+[ "$out" = "3 2 " ] || { echo "$out"; exit 1; }
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# --stats prints the copy and delete counts and a line for every builtin
+# called, with its calls, time and latency histogram, on exit, and the
+# stats builtin returns the same figures while running.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/calls.lspy" <<'LSPY'
+(+ 1 2)
+(+ 3 4)
+(* 2 2)
+(print (head (stats)))
+(print (tail (tail (tail (tail (stats))))))
+LSPY
+
+out=$(./strings "$dir/calls.lspy" 2> "$dir/err")
+[ ! -s "$dir/err" ] || { cat "$dir/err"; exit 1; }
+[ "$out" = '{{copies 0}} 
+{} ' ] || { printf '%s\n' "$out"; exit 1; }
+
+out=$(./strings --stats "$dir/calls.lspy" 2> "$dir/err")
+printf '%s\n' "$out" | grep -q '^{{copies [1-9][0-9]*}} $' || { printf '%s\n' "$out"; exit 1; }
+printf '%s\n' "$out" | grep -q '^{{"head" 1 [0-9]* {[0-9 ]*}} {"+" 2 ' || { printf '%s\n' "$out"; exit 1; }
+
+grep -q '^copies [1-9][0-9]*$' "$dir/err" || { cat "$dir/err"; exit 1; }
+grep -q '^builtin + calls 2 ns ' "$dir/err" || { cat "$dir/err"; exit 1; }
+grep -q '^builtin \* calls 1 ns ' "$dir/err" || { cat "$dir/err"; exit 1; }
+grep -q '^builtin - ' "$dir/err" && { cat "$dir/err"; exit 1; }
+
+# The histogram has a bucket for every power of two and counts every call
+awk '$1 == "builtin" {
+  if (NF != 7 + 40) { bad = 1 }
+  for (i = 8; i <= NF; i++) { sum += $i }
+  if (sum != $4) { bad = 1 }
+  sum = 0
+} END { exit bad }' "$dir/err" || { cat "$dir/err"; exit 1; }
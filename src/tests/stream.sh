@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Expressions read from stdin may span lines, and brackets inside
+# strings and comments must not end them early.
+#
+
+out=$(./strings - <<'LSPY' 2>&1
+(def {xs} {
+  "(" ; )
+  ")}"
+  {1 2}
+})
+(print xs) (print "two
+lines")
+(print (+ 1
+  2))
+LSPY
+)
+expected='{"(" ")}" {1 2}} 
+"two\nlines" 
+3 '
+[ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
@@ -0,0 +1,74 @@
+/*
+** Test for the mpc streaming API.
+**
+** Usage: stream_api
+**
+** Feeds chunks to streams and checks what comes out. Exits with status
+** 1, after printing what was wrong, if any check fails.
+*/
+
+#include "../mpc.h"
+
+static int failed = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) { fprintf(stderr, "failed: %s\n", what); failed = 1; }
+}
+
+/* Return the next output, or NULL for no output or an error */
+static char* next(mpc_stream_t* s, int* status) {
+  mpc_result_t r;
+  *status = mpc_stream_next(s, &r);
+  if (*status == MPC_STREAM_OUTPUT) { return r.output; }
+  if (*status == MPC_STREAM_ERROR) { mpc_err_delete(r.error); }
+  return NULL;
+}
+
+int main(void) {
+
+  int status;
+  char* x;
+
+  /* An empty match is an error and its line is skipped */
+  mpc_parser_t* digits = mpc_many(mpcf_strfold, mpc_digit());
+  mpc_stream_t* s = mpc_stream_new("<test>", digits, free);
+  mpc_stream_feed(s, "abc\n12 ", 7);
+  x = next(s, &status);
+  check(status == MPC_STREAM_ERROR, "empty match is an error");
+  x = next(s, &status);
+  check(x && strcmp(x, "12") == 0, "line after an empty match is read");
+  free(x);
+  mpc_stream_finish(s);
+  next(s, &status);
+  check(status == MPC_STREAM_NONE, "stream ends after an empty match");
+  mpc_stream_delete(s);
+  mpc_delete(digits);
+
+  /* Lists of words, with strings and comments which hide brackets. The
+     parts of a list are joined, strings without quotes and comments
+     without their semicolon */
+  mpc_parser_t* list = mpc_new("list");
+  mpc_define(list, mpc_tok(mpc_or(4,
+    mpc_and(3, mpcf_strfold,
+      mpc_char('('), mpc_many(mpcf_strfold, list), mpc_char(')'), free, free),
+    mpc_many1(mpcf_strfold, mpc_lower()),
+    mpc_string_lit(),
+    mpc_and(2, mpcf_snd_free, mpc_char(';'), mpc_many(mpcf_strfold, mpc_noneof("\n")), free))));
+
+  s = mpc_stream_new("<test>", list, free);
+  mpc_stream_brackets(s, "(", ")", "\"", ";");
+  const char* lines[] = { "(a\n", "  \")\" ; )\n", "  (b c)\n", ")\n" };
+  for (int i = 0; i < 3; i++) {
+    mpc_stream_feed(s, lines[i], strlen(lines[i]));
+    x = next(s, &status);
+    check(status == MPC_STREAM_NONE, "nothing until the list is closed");
+  }
+  mpc_stream_feed(s, lines[3], strlen(lines[3]));
+  x = next(s, &status);
+  check(x && strcmp(x, "(a) )(bc))") == 0, "closed list is read whole");
+  free(x);
+  mpc_stream_delete(s);
+  mpc_cleanup(1, list);
+
+  return failed;
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+#
+# The streaming API on its own, through a small C program.
+#
+
+./tests/stream_api
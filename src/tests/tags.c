@@ -0,0 +1,127 @@
+/*
+** Test for mpc tag ids.
+**
+** Usage: tags
+**
+** Parses a small program with a grammar built by mpca_lang and checks
+** each node's tag and rule id, that tags are shared between parses,
+** and that building another parser leaves the tags of a live tree
+** alone. Exits with status 1, after printing what was wrong, if any
+** check fails.
+*/
+
+#include "../mpc.h"
+
+static int failed = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "failed: %s\n", what);
+    failed = 1;
+  }
+}
+
+static void check_node(mpc_ast_t* t, const char* tag, const char* rule) {
+  if (strcmp(t->tag, tag) != 0) {
+    fprintf(stderr, "failed: tag '%s', expected '%s'\n", t->tag, tag);
+    failed = 1;
+  }
+  if (t->id != (rule ? mpc_tag_id(rule) : 0)) {
+    fprintf(stderr, "failed: '%s' has id %i for rule '%s'\n",
+      t->tag, t->id, rule ? rule : "(none)");
+    failed = 1;
+  }
+  if (rule && strcmp(mpc_tag_name(t->id), rule) != 0) {
+    fprintf(stderr, "failed: id %i names '%s', expected '%s'\n",
+      t->id, mpc_tag_name(t->id), rule);
+    failed = 1;
+  }
+}
+
+static mpc_ast_t* parse(const char* input, mpc_parser_t* p) {
+  mpc_result_t r;
+  if (!mpc_parse("<test>", input, p, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    exit(1);
+  }
+  return r.output;
+}
+
+static void run(void) {
+
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Sexpr  = mpc_new("sexpr");
+  mpc_parser_t* Qexpr  = mpc_new("qexpr");
+  mpc_parser_t* Expr   = mpc_new("expr");
+  mpc_parser_t* Lispy  = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                    \
+      number : /-?[0-9]+/ ;                              \
+      symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
+      sexpr  : '(' <expr>* ')' ;                         \
+      qexpr  : '{' <expr>* '}' ;                         \
+      expr   : <number> | <symbol> | <sexpr> | <qexpr> ; \
+      lispy  : /^/ <expr>* /$/ ;                         \
+    ",
+    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  mpc_ast_t* a = parse("(+ 1 {x}) 2", Lispy);
+
+  check(a->children_num == 4, "root has four children");
+  check_node(a, ">", NULL);
+  check_node(a->children[0], "regex", NULL);
+  check_node(a->children[3], "regex", NULL);
+
+  mpc_ast_t* s = a->children[1];
+  check_node(s, "expr|sexpr|>", "sexpr");
+  check_node(s->children[0], "char", NULL);
+  check_node(s->children[1], "expr|symbol|regex", "symbol");
+  check_node(s->children[2], "expr|number|regex", "number");
+  check_node(s->children[3], "expr|qexpr|>", "qexpr");
+  check_node(s->children[3]->children[1], "expr|symbol|regex", "symbol");
+  check_node(a->children[2], "expr|number|regex", "number");
+
+  /* A second parse shares every tag with the first */
+  mpc_ast_t* b = parse("(+ 1 {x}) 2", Lispy);
+  check(mpc_ast_eq(a, b), "second parse gives the same tree");
+  check(b->children[1]->children[1]->tag == s->children[1]->tag,
+    "second parse shares the symbol tag");
+  check(b->children[2]->tag == s->children[2]->tag,
+    "a number at the top level shares the tag of one in a list");
+  mpc_ast_delete(b);
+
+  /* Building a parser cleans up mpc's own parsers but not the tags */
+  mpc_parser_t* re = mpc_re("ab+");
+  mpc_delete(re);
+  check(strcmp(s->children[1]->tag, "expr|symbol|regex") == 0,
+    "tags survive building a regex");
+  mpc_ast_delete(a);
+
+  /* Tags added by hand */
+  mpc_ast_t* c = mpc_ast_new("regex", "y");
+  mpc_ast_add_tag(c, "symbol");
+  mpc_ast_add_tag(c, "expr");
+  check_node(c, "expr|symbol|regex", "symbol");
+  mpc_ast_add_root_tag(c, "top>");
+  check_node(c, "topexpr|symbol|regex", "symbol");
+  mpc_ast_tag(c, "plain");
+  check_node(c, "plain", NULL);
+  mpc_ast_delete(c);
+
+  check(mpc_tag_name(0) == NULL, "id 0 has no name");
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+}
+
+int main(int argc, char** argv) {
+
+  /* The second run starts from the table freed by mpc_cleanup */
+  run();
+  check(mpc_tag_name(1) == NULL, "mpc_cleanup frees the tag table");
+  run();
+
+  return failed;
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+#
+# Tags and rule ids of mpc trees, through a small C program.
+#
+
+./tests/tags
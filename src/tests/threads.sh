@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Files evaluated on their own threads share the frozen environment
+# built before them but never see each other's definitions, and
+# allocating on many threads at once gives the same results as on one.
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Each file redefines a prelude function and a global of its own
+for i in 1 2 3 4 5 6 7 8; do
+  cat > "$dir/$i.lspy" <<LSPY
+(def {mine} $i)
+(fun {map f l} {$i})
+(def {words} (pmap (\\ {x} {to-string (list x "-$i")}) (take 40 (drop mine {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48}))))
+(print mine (map head {1}) (len words) (fst words) (last words))
+(print (await (spawn {+ mine (sum (pmap (\\ {x} {fib 10}) {1 2 3}))})))
+(print (foldl + 0 (filter (\\ {x} {> x mine}) {1 2 3 4 5 6 7 8})))
+LSPY
+done
+
+files=$(for i in 1 2 3 4 5 6 7 8; do printf '%s ' "$dir/$i.lspy"; done)
+
+# One file at a time, each in a process of its own
+expected=$(for f in $files; do ./strings prelude.lspy "$f" 2>&1; done)
+case "$expected" in *Error*) printf '%s\n' "$expected"; exit 1 ;; esac
+
+for run in 1 2 3; do
+  out=$(./strings prelude.lspy --workers 4 --parallel 8 $files 2>&1)
+  [ "$out" = "$expected" ] || { printf '%s\n' "$out"; exit 1; }
+done
+
+# The prelude map was never replaced for anyone
+printf '(print (map (\\ {x} {* x 2}) {1 2}))\n' > "$dir/check.lspy"
+out=$(./strings prelude.lspy --parallel 2 "$dir/1.lspy" "$dir/check.lspy" 2>&1 | tail -1)
+[ "$out" = "{2 4} " ] || { printf '%s\n' "$out"; exit 1; }